@@ -0,0 +1,152 @@
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <time.h>
+
+#include "clocksync.h"
+#include "main.h"
+#include "pli.h"
+#include "protocol.h"
+#include "serial.h"
+
+// Sets the regulator clock only when it drifted: the moment its seconds
+// register changes is found by polling it, which gives the phase of its ticks
+// to within a round trip. Writing the seconds register starts a new second, so
+// it is written to arrive at a second boundary of system time, sent earlier by
+// half of the shortest round trip, together with other fields which differ.
+
+static unsigned char clock_locations[CLOCK_FIELDS] = {CLOCK_DAY, CLOCK_TENTHS, CLOCK_MINUTES, CLOCK_SECONDS};
+static char *clock_names[CLOCK_FIELDS] = {"day", "tenths of an hour", "minutes", "seconds"};
+
+// Seconds are written first, as the new second starts with them
+static int write_order[CLOCK_FIELDS] = {3, 0, 1, 2};
+
+// Reads the seconds register, bypassing the cache; it was read in the middle
+// of the exchange
+static int read_seconds(solar_ctx *ctx, long long *at, long long *rtt) {
+	invalidate_cache(ctx);
+
+	long long start = realtime_ms();
+	int value = read_processor(ctx, CLOCK_SECONDS);
+	long long end = realtime_ms();
+
+	*at = (start + end) / 2;
+	*rtt = end - start;
+	return value;
+}
+
+// Fields of the regulator clock at seconds after midnight of day
+static void regulator_fields(int day, long long seconds, int fields[]) {
+	fields[0] = day + seconds / (24 * 60 * 60);
+	seconds %= 24 * 60 * 60;
+	fields[1] = seconds / 360;
+	fields[2] = (seconds % 360) / 60;
+	fields[3] = seconds % 60;
+}
+
+// Fields of local time at milliseconds since the epoch, as written by
+// 'setdaytime' command
+static void local_fields(long long ms, int fields[]) {
+	time_t seconds = ms / 1000;
+	struct tm local;
+	localtime_r(&seconds, &local);
+	fields[0] = local.tm_mday - 1;
+	fields[1] = local.tm_hour * 10 + local.tm_min / 6;
+	fields[2] = local.tm_min % 6;
+	fields[3] = local.tm_sec;
+}
+
+int pli_syncclock(solar_ctx *ctx) {
+	long long before;
+	long long at;
+	long long rtt;
+	long long latency;
+	int first;
+	int seconds;
+
+	if ((first = read_seconds(ctx, &before, &rtt)) == -1) return 3;
+	latency = rtt;
+
+	// The tick happened between the last two reads
+	long long deadline = before + CLOCK_TICK_WAIT;
+	while (1) {
+		if ((seconds = read_seconds(ctx, &at, &rtt)) == -1) return 3;
+		if (rtt < latency) latency = rtt;
+		if (seconds != first) break;
+		if (at > deadline) {
+			fprintf(stderr, "Regulator clock is not running.\n");
+			return 3;
+		}
+		before = at;
+	}
+	long long tick = (before + at) / 2;
+
+	// Other fields do not change until the next tick
+	int current[CLOCK_FIELDS];
+	int i;
+	if (prefetch_processor(ctx, clock_locations, CLOCK_FIELDS - 1) == -1) return 3;
+	for (i = 0; i < CLOCK_FIELDS - 1; i++) {
+		if ((current[i] = read_processor(ctx, clock_locations[i])) == -1) return 3;
+	}
+	current[CLOCK_FIELDS - 1] = seconds;
+
+	// Drift of the time of day, the day is compared separately
+	int system[CLOCK_FIELDS];
+	local_fields(tick, system);
+	long long drift = ((current[1] * 6 + current[2]) * 60 + current[3]) * 1000LL - ((system[1] * 6 + system[2]) * 60 + system[3]) * 1000LL - tick % 1000;
+	if (drift > 12 * 60 * 60 * 1000LL) drift -= 24 * 60 * 60 * 1000LL;
+	else if (drift < -12 * 60 * 60 * 1000LL) drift += 24 * 60 * 60 * 1000LL;
+
+	if ((llabs(drift) <= CLOCK_THRESHOLD) && (current[0] == system[0])) {
+		if (plain_output == 0) fprintf(out, "Regulator clock is %.1f s %s, not set (round trip %lld ms).\n", llabs(drift) / 1000.0, (drift > 0) ? "ahead" : "behind", rtt);
+		else fprintf(out, "%lld\n", drift);
+		return 0;
+	}
+
+	// Writes arrive at the next second boundary of system time which can still
+	// be made, the seconds register is always written to start the second then
+	latency /= 2;
+	long long target = (realtime_ms() + latency + CLOCK_GUARD) / 1000 * 1000 + 1000;
+
+	// Fields the regulator clock would show then; a tick close to the boundary
+	// can have changed them or not, so all are written
+	int fields[CLOCK_FIELDS];
+	int expected[CLOCK_FIELDS];
+	long long ticks = (target - tick) / 1000;
+	long long phase = (target - tick) % 1000;
+	regulator_fields(current[0], (current[1] * 6 + current[2]) * 60 + current[3] + ticks, fields);
+	local_fields(target, expected);
+	int uncertain = (phase < CLOCK_GUARD) || (phase > 1000 - CLOCK_GUARD);
+
+	unsigned char requests[CLOCK_FIELDS][FRAME_SIZE];
+	unsigned char *frames[CLOCK_FIELDS];
+	int written[CLOCK_FIELDS];
+	int count = 0;
+	for (i = 0; i < CLOCK_FIELDS; i++) {
+		int f = write_order[i];
+		written[f] = (f == CLOCK_FIELDS - 1) || (uncertain != 0) || (fields[f] != expected[f]);
+		if (written[f] == 0) continue;
+		encode_request(requests[count], OP_WRITE_PROCESSOR, clock_locations[f], expected[f]);
+		frames[count] = requests[count];
+		count++;
+	}
+
+	sleep_ms(target - latency - realtime_ms());
+
+	invalidate_cache(ctx);
+	if (write_frames(ctx, frames, count) == -1) return 3;
+
+	if (plain_output == 0) {
+		fprintf(out, "Regulator clock was %.1f s %s, set", llabs(drift) / 1000.0, (drift > 0) ? "ahead" : "behind");
+		int listed = 0;
+		for (i = 0; i < CLOCK_FIELDS; i++) {
+			if (written[i] == 0) continue;
+			fprintf(out, "%s %s", (listed == 0) ? "" : ",", clock_names[i]);
+			listed++;
+		}
+		fprintf(out, " (latency %lld ms).\n", latency);
+	}
+	else fprintf(out, "%lld\n", drift);
+
+	return 0;
+}
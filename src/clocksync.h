@@ -0,0 +1,19 @@
+#ifndef CLOCKSYNC_H_
+#define CLOCKSYNC_H_
+
+#include "solar.h"
+
+// Processor registers of the regulator clock
+#define CLOCK_DAY 0x31 // Day in a month, from 0
+#define CLOCK_TENTHS 0x30 // Tenths of an hour
+#define CLOCK_MINUTES 0x2F // Minutes after the tenth of an hour
+#define CLOCK_SECONDS 0x2E
+#define CLOCK_FIELDS 4
+
+#define CLOCK_THRESHOLD 100 // Milliseconds of drift which is left alone
+#define CLOCK_TICK_WAIT 1500 // Milliseconds to wait for the seconds register to change
+#define CLOCK_GUARD 50 // Milliseconds around a tick of the clock when its fields are uncertain
+
+int pli_syncclock(solar_ctx *ctx);
+
+#endif /* CLOCKSYNC_H_ */
@@ -0,0 +1,390 @@
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <unistd.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+#include "daemon.h"
+#include "output.h"
+#include "main.h"
+#include "protocol.h"
+#include "serial.h"
+
+typedef struct {
+	int fd;
+	int length;
+	char request[REQUEST_SIZE];
+} client;
+
+static volatile sig_atomic_t terminate = 0;
+
+static void stopdaemon(int signal) {
+	terminate = 1;
+}
+
+// Writes all size bytes until deadline, so that a client which does not read
+// its response cannot block the daemon
+static int write_all(int fd, char *data, int size, long long deadline) {
+	int count;
+	int w = 0;
+
+	while (w < size) {
+		long long remaining = deadline - monotonic_ms();
+		if (remaining <= 0) {
+			errno = ETIMEDOUT;
+			return -1;
+		}
+
+		struct pollfd pfd = {fd, POLLOUT, 0};
+		if (poll(&pfd, 1, remaining) == -1) {
+			if (errno == EINTR) continue;
+			return -1;
+		}
+
+		if ((count = write(fd, data + w, size - w)) == -1) {
+			if ((errno == EINTR) || (errno == EAGAIN)) continue;
+			return -1;
+		}
+		w += count;
+	}
+
+	return 0;
+}
+
+static int unix_address(struct sockaddr_un *address) {
+	if (strlen(socket_path) >= sizeof(address->sun_path)) {
+		fprintf(stderr, "Socket path '%s' is too long.\n", socket_path);
+		return -1;
+	}
+
+	memset(address, 0, sizeof(*address));
+	address->sun_family = AF_UNIX;
+	strcpy(address->sun_path, socket_path);
+
+	return 0;
+}
+
+// Executes commands in the request line and sends their output to the client,
+// preceded by a line with the exit status
+static void serve(solar_ctx *ctx, client *c) {
+	command *batch[REQUEST_SIZE / 2];
+	char *names[REQUEST_SIZE / 2];
+	int count = 0;
+	int ret = 0;
+
+	char *data = NULL;
+	size_t size = 0;
+	FILE *stream = open_memstream(&data, &size);
+	if (stream == NULL) {
+		fprintf(stderr, "Could not allocate memory: %s.\n", strerror(errno));
+		return;
+	}
+
+	out = stream;
+	plain_output = 0;
+	output_format = FORMAT_TEXT;
+	arguments = names;
+	arguments_count = 0;
+
+	char *saveptr;
+	char *name;
+	for (name = strtok_r(c->request, " \t\r\n", &saveptr); name != NULL; name = strtok_r(NULL, " \t\r\n", &saveptr)) {
+		// Arguments of the last command
+		if ((count > 0) && (batch[count - 1]->arguments != 0)) {
+			names[arguments_count++] = name;
+			continue;
+		}
+
+		if (strcmp(name, "-p") == 0) {
+			plain_output = 1;
+			continue;
+		}
+
+		if (strcmp(name, "-o") == 0) {
+			name = strtok_r(NULL, " \t\r\n", &saveptr);
+			if ((name == NULL) || (parse_format(name) == -1)) {
+				fprintf(out, "Invalid output format.\n");
+				ret = 1;
+				break;
+			}
+			output_format = parse_format(name);
+			continue;
+		}
+
+		command *j = findcommand(iface->commands, name);
+		if (j == NULL) j = findcommand(builtin_commands, name);
+
+		if (j == NULL) {
+			fprintf(out, "Unsupported command '%s' of interface '%s'.\n", name, iface->name);
+			ret = 1;
+			break;
+		}
+
+		// Commands which do not return would block all other clients, and the
+		// regulator and files of the daemon are not for clients to change
+		if (j->flags != 0) {
+			fprintf(out, "Command '%s' cannot be executed by the daemon.\n", name);
+			ret = 1;
+			break;
+		}
+
+		batch[count++] = j;
+	}
+
+	if ((ret == 0) && (count == 0)) {
+		fprintf(out, "Missing command argument of interface '%s'.\n", iface->name);
+		ret = 1;
+	}
+
+	int i;
+	for (i = 0; (i < count) && (ret == 0); i++) {
+		ret = batch[i]->function(ctx);
+	}
+
+	// Every request is its own session
+	if ((iface->finish != NULL) && (iface->finish(ctx) != 0) && (ret == 0)) ret = 3;
+
+	flush_metrics();
+
+	out = stdout;
+	fclose(stream);
+
+	char status[16];
+	snprintf(status, sizeof(status), "%d\n", ret);
+	long long deadline = monotonic_ms() + DAEMON_WRITE_TIMEOUT;
+	if ((write_all(c->fd, status, strlen(status), deadline) == -1) || (write_all(c->fd, data, size, deadline) == -1)) {
+		fprintf(stderr, "Could not send response to client: %s.\n", strerror(errno));
+	}
+
+	free(data);
+}
+
+// Removes a socket left behind by a previous daemon, but not another file or a
+// socket on which a daemon still listens
+static int remove_socket(struct sockaddr_un *address) {
+	struct stat info;
+	if (lstat(socket_path, &info) == -1) {
+		if (errno == ENOENT) return 0;
+		fprintf(stderr, "Could not check socket '%s': %s.\n", socket_path, strerror(errno));
+		return -1;
+	}
+
+	if (!S_ISSOCK(info.st_mode)) {
+		fprintf(stderr, "File '%s' exists and is not a socket.\n", socket_path);
+		return -1;
+	}
+
+	int probe;
+	if ((probe = socket(AF_UNIX, SOCK_STREAM, 0)) == -1) {
+		fprintf(stderr, "Could not create socket: %s.\n", strerror(errno));
+		return -1;
+	}
+	int listening = (connect(probe, (struct sockaddr *)address, sizeof(*address)) == 0);
+	int refused = (errno == ECONNREFUSED);
+	close(probe);
+
+	if (listening) {
+		fprintf(stderr, "Another daemon is listening on socket '%s'.\n", socket_path);
+		return -1;
+	}
+	if (refused && (unlink(socket_path) == -1) && (errno != ENOENT)) {
+		fprintf(stderr, "Could not remove socket '%s': %s.\n", socket_path, strerror(errno));
+		return -1;
+	}
+
+	return 0;
+}
+
+// Serves commands of local clients over a Unix domain socket, keeping serial
+// port open and locked and executing requests one at a time
+int run_daemon(solar_ctx *ctx) {
+	if (socket_path == NULL) socket_path = DEFAULT_SOCKET;
+	if (ctx->cache_maxage < 0) ctx->cache_maxage = DEFAULT_CACHE_MAXAGE;
+
+	struct sockaddr_un address;
+	if (unix_address(&address) == -1) return 2;
+
+	int listener;
+	if ((listener = socket(AF_UNIX, SOCK_STREAM, 0)) == -1) {
+		fprintf(stderr, "Could not create socket: %s.\n", strerror(errno));
+		return 2;
+	}
+
+	if (remove_socket(&address) == -1) {
+		close(listener);
+		return 2;
+	}
+
+	// Socket is removed at the end only if it was not replaced meanwhile
+	struct stat bound;
+	if ((bind(listener, (struct sockaddr *)&address, sizeof(address)) == -1) || (listen(listener, DAEMON_CLIENTS) == -1) || (lstat(socket_path, &bound) == -1)) {
+		fprintf(stderr, "Could not listen on socket '%s': %s.\n", socket_path, strerror(errno));
+		close(listener);
+		return 2;
+	}
+
+	signal(SIGPIPE, SIG_IGN);
+	signal(SIGTERM, stopdaemon);
+	signal(SIGINT, stopdaemon);
+
+	client clients[DAEMON_CLIENTS];
+	struct pollfd fds[DAEMON_CLIENTS + 1];
+	int i;
+	for (i = 0; i < DAEMON_CLIENTS; i++) {
+		clients[i].fd = -1;
+	}
+
+	while (terminate == 0) {
+		int slots = 0;
+		for (i = 0; i < DAEMON_CLIENTS; i++) {
+			fds[i + 1].fd = clients[i].fd;
+			fds[i + 1].events = POLLIN;
+			if (clients[i].fd == -1) slots++;
+		}
+		// We stop accepting new clients while all slots are in use
+		fds[0].fd = (slots > 0) ? listener : -1;
+		fds[0].events = POLLIN;
+
+		if (poll(fds, DAEMON_CLIENTS + 1, -1) == -1) {
+			if (errno == EINTR) continue;
+			fprintf(stderr, "Could not wait for clients: %s.\n", strerror(errno));
+			break;
+		}
+
+		if ((fds[0].revents & POLLIN) != 0) {
+			int fdc;
+			if ((fdc = accept(listener, NULL, NULL)) == -1) {
+				if (errno != EINTR) fprintf(stderr, "Could not accept client: %s.\n", strerror(errno));
+			}
+			else if (fcntl(fdc, F_SETFL, fcntl(fdc, F_GETFL) | O_NONBLOCK) == -1) {
+				fprintf(stderr, "Could not set client non-blocking: %s.\n", strerror(errno));
+				close(fdc);
+			}
+			else {
+				for (i = 0; clients[i].fd != -1; i++);
+				clients[i].fd = fdc;
+				clients[i].length = 0;
+			}
+		}
+
+		for (i = 0; i < DAEMON_CLIENTS; i++) {
+			if ((clients[i].fd == -1) || (fds[i + 1].fd != clients[i].fd) || (fds[i + 1].revents == 0)) continue;
+
+			client *c = &clients[i];
+			int count = read(c->fd, c->request + c->length, REQUEST_SIZE - 1 - c->length);
+			if ((count == -1) && ((errno == EINTR) || (errno == EAGAIN))) continue;
+
+			if (count > 0) {
+				c->length += count;
+				c->request[c->length] = '\0';
+
+				if (strchr(c->request, '\n') != NULL) {
+					serve(ctx, c);
+				}
+				else if (c->length < REQUEST_SIZE - 1) {
+					// Waits for the rest of the request line
+					continue;
+				}
+				else {
+					char *error = "1\nRequest too long.\n";
+					write_all(c->fd, error, strlen(error), monotonic_ms() + DAEMON_WRITE_TIMEOUT);
+				}
+			}
+
+			close(c->fd);
+			c->fd = -1;
+		}
+	}
+
+	for (i = 0; i < DAEMON_CLIENTS; i++) {
+		if (clients[i].fd != -1) close(clients[i].fd);
+	}
+	close(listener);
+
+	struct stat info;
+	if ((lstat(socket_path, &info) == 0) && (info.st_dev == bound.st_dev) && (info.st_ino == bound.st_ino)) unlink(socket_path);
+
+	return 0;
+}
+
+// Sends commands to the daemon and outputs its response
+int run_client(command **batch, int count) {
+	struct sockaddr_un address;
+	if (unix_address(&address) == -1) return 2;
+
+	int fd;
+	if ((fd = socket(AF_UNIX, SOCK_STREAM, 0)) == -1) {
+		fprintf(stderr, "Could not create socket: %s.\n", strerror(errno));
+		return 2;
+	}
+
+	if (connect(fd, (struct sockaddr *)&address, sizeof(address)) == -1) {
+		fprintf(stderr, "Could not connect to daemon socket '%s': %s.\n", socket_path, strerror(errno));
+		close(fd);
+		return 2;
+	}
+
+	char request[REQUEST_SIZE];
+	int length = snprintf(request, sizeof(request), "%s-o %s", (plain_output != 0) ? "-p " : "", format_names[output_format]);
+	int i;
+	for (i = 0; i < count; i++) {
+		length += snprintf(request + length, (length < sizeof(request)) ? sizeof(request) - length : 0, " %s", batch[i]->name);
+	}
+	for (i = 0; i < arguments_count; i++) {
+		length += snprintf(request + length, (length < sizeof(request)) ? sizeof(request) - length : 0, " %s", arguments[i]);
+	}
+	if (length >= sizeof(request) - 1) {
+		fprintf(stderr, "Too many commands for the daemon.\n");
+		close(fd);
+		return 1;
+	}
+	request[length++] = '\n';
+
+	if (write_all(fd, request, length, monotonic_ms() + DAEMON_WRITE_TIMEOUT) == -1) {
+		fprintf(stderr, "Could not send request to daemon: %s.\n", strerror(errno));
+		close(fd);
+		return 2;
+	}
+
+	// First line of the response is exit status, output of commands follows
+	int ret = 0;
+	char c;
+	int r;
+	while ((r = read(fd, &c, 1)) != 0) {
+		if (r == -1) {
+			if (errno == EINTR) continue;
+			break;
+		}
+		if ((c < '0') || (c > '9')) break;
+		ret = ret * 10 + (c - '0');
+	}
+	if ((r != 1) || (c != '\n')) {
+		fprintf(stderr, "Invalid response from daemon.\n");
+		close(fd);
+		return 2;
+	}
+
+	char buffer[REQUEST_SIZE];
+	while ((r = read(fd, buffer, sizeof(buffer))) != 0) {
+		if (r == -1) {
+			if (errno == EINTR) continue;
+			fprintf(stderr, "Could not read response from daemon: %s.\n", strerror(errno));
+			close(fd);
+			return 2;
+		}
+		fwrite(buffer, 1, r, out);
+	}
+
+	if (close(fd) == -1) {
+		fprintf(stderr, "Could not close daemon socket: %s.\n", strerror(errno));
+		return 2;
+	}
+
+	return ret;
+}
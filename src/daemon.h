@@ -0,0 +1,15 @@
+#ifndef DAEMON_H_
+#define DAEMON_H_
+
+#include "main.h"
+
+#define DEFAULT_SOCKET "/var/run/solar.sock"
+#define DEFAULT_CACHE_MAXAGE 1000
+#define DAEMON_CLIENTS 32
+#define REQUEST_SIZE 512
+#define DAEMON_WRITE_TIMEOUT 1000 // Milliseconds for a response to be taken by a client
+
+int run_daemon(solar_ctx *ctx);
+int run_client(command **batch, int count);
+
+#endif /* DAEMON_H_ */
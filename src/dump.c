@@ -0,0 +1,163 @@
+#include <string.h>
+#include <stdio.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <limits.h>
+
+#include "dump.h"
+#include "main.h"
+#include "pli.h"
+#include "protocol.h"
+
+// Reads at most size bytes of a file, returns number of bytes read
+static int read_file(char *path, unsigned char *buffer, int size) {
+	int file;
+	if ((file = open(path, O_RDONLY)) == -1) return -1;
+
+	int count;
+	int r = 0;
+	while ((r < size) && ((count = read(file, buffer + r, size - r)) != 0)) {
+		if (count == -1) {
+			if (errno == EINTR) continue;
+			int e = errno;
+			close(file);
+			errno = e;
+			return -1;
+		}
+		r += count;
+	}
+
+	close(file);
+	return r;
+}
+
+static int write_file(int file, unsigned char *buffer, int size) {
+	int count;
+	int w = 0;
+	while (w < size) {
+		if ((count = write(file, buffer + w, size - w)) == -1) {
+			if (errno == EINTR) continue;
+			return -1;
+		}
+		w += count;
+	}
+	return 0;
+}
+
+static void print_hex(unsigned char *memory) {
+	int i;
+	for (i = 0; i < DUMP_SIZE; i++) {
+		if ((i % 16) == 0) fprintf(out, "%02X:", i);
+		fprintf(out, " %02X", memory[i]);
+		if ((i % 16) == 15) fprintf(out, "\n");
+	}
+}
+
+static void print_changes(unsigned char *previous, unsigned char *memory) {
+	int i;
+	for (i = 0; i < DUMP_SIZE; i++) {
+		if (memory[i] == previous[i]) continue;
+		if (plain_output != 0) fprintf(out, "%02X %02X %02X\n", i, previous[i], memory[i]);
+		else fprintf(out, "%02X: %02X -> %02X\n", i, previous[i], memory[i]);
+	}
+}
+
+// Reads the whole memory space with op (0x14 processor, 0x48 EEPROM) into a
+// file, in pipelined chunks which are stored into a temporary file as they are
+// read and renamed to file when complete
+// An interrupted EEPROM dump continues from '<file>.part' where it stopped
+// when run again. Processor memory changes all the time, so its dump starts
+// over in '<file>.new', and a part of one kind of dump is never continued by
+// the other.
+static int dump(solar_ctx *ctx, unsigned char op, char *file) {
+	unsigned char memory[DUMP_SIZE];
+	unsigned char previous[DUMP_SIZE];
+	char part[PATH_MAX];
+	snprintf(part, sizeof(part), (op == 0x48) ? "%s.part" : "%s.new", file);
+
+	// Previous dump is read first as it can be the same file
+	if (since_file != NULL) {
+		int size;
+		if ((size = read_file(since_file, previous, DUMP_SIZE)) == -1) {
+			fprintf(stderr, "Could not read dump file '%s': %s.\n", since_file, strerror(errno));
+			return 2;
+		}
+		if (size != DUMP_SIZE) {
+			fprintf(stderr, "Invalid dump file '%s'.\n", since_file);
+			return 2;
+		}
+	}
+
+	int done = 0;
+	if ((op == 0x48) && ((done = read_file(part, memory, DUMP_SIZE)) == -1)) {
+		if (errno != ENOENT) {
+			fprintf(stderr, "Could not read dump file '%s': %s.\n", part, strerror(errno));
+			return 2;
+		}
+		done = 0;
+	}
+
+	int output;
+	if ((output = open(part, O_WRONLY | O_CREAT | O_APPEND | ((done == 0) ? O_TRUNC : 0), 0644)) == -1) {
+		fprintf(stderr, "Could not open dump file '%s': %s.\n", part, strerror(errno));
+		return 2;
+	}
+
+	int location;
+	for (location = done; location < DUMP_SIZE; location += DUMP_CHUNK) {
+		unsigned char locations[DUMP_CHUNK];
+		int values[DUMP_CHUNK];
+		int count = (DUMP_SIZE - location < DUMP_CHUNK) ? (DUMP_SIZE - location) : DUMP_CHUNK;
+		int i;
+		for (i = 0; i < count; i++) {
+			locations[i] = location + i;
+		}
+
+		// Registers read before the link failed are still written, so that the
+		// dump can be resumed after them
+		int linked = (read_registers(ctx, op, locations, values, count) != -1);
+
+		for (i = 0; i < count; i++) {
+			if ((values[i] == -1) && (linked == 0)) break;
+
+			// Reads again a register rejected with an error code to report it
+			if ((values[i] == -1) && ((values[i] = (op == 0x14) ? read_processor(ctx, locations[i]) : read_eprom(ctx, locations[i])) == -1)) break;
+			memory[location + i] = values[i];
+		}
+
+		if (write_file(output, memory + location, i) == -1) {
+			fprintf(stderr, "Could not write dump file '%s': %s.\n", part, strerror(errno));
+			close(output);
+			return 2;
+		}
+
+		if (i < count) {
+			close(output);
+			return 3;
+		}
+	}
+
+	if (close(output) == -1) {
+		fprintf(stderr, "Could not close dump file '%s': %s.\n", part, strerror(errno));
+		return 2;
+	}
+
+	if (rename(part, file) == -1) {
+		fprintf(stderr, "Could not rename dump file '%s' to '%s': %s.\n", part, file, strerror(errno));
+		return 2;
+	}
+
+	if (since_file != NULL) print_changes(previous, memory);
+	else if (hex_output != 0) print_hex(memory);
+
+	return 0;
+}
+
+int pli_dumpram(solar_ctx *ctx) {
+	return dump(ctx, 0x14, (dump_file != NULL) ? dump_file : DEFAULT_RAM_FILE);
+}
+
+int pli_dumpeeprom(solar_ctx *ctx) {
+	return dump(ctx, 0x48, (dump_file != NULL) ? dump_file : DEFAULT_EEPROM_FILE);
+}
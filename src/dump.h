@@ -0,0 +1,14 @@
+#ifndef DUMP_H_
+#define DUMP_H_
+
+#include "solar.h"
+
+#define DUMP_SIZE 256
+#define DUMP_CHUNK 16
+#define DEFAULT_RAM_FILE "solar.ram"
+#define DEFAULT_EEPROM_FILE "solar.eeprom"
+
+int pli_dumpram(solar_ctx *ctx);
+int pli_dumpeeprom(solar_ctx *ctx);
+
+#endif /* DUMP_H_ */
@@ -0,0 +1,162 @@
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
+#include <math.h>
+
+#include "energy.h"
+#include "main.h"
+#include "pli.h"
+#include "protocol.h"
+#include "serial.h"
+#include "files.h"
+
+// Integrates charge and load currents and power over time with the
+// trapezoidal rule into running totals kept in a state file, so that energy
+// budgets need only a few reads a minute instead of a stream of raw samples
+
+typedef struct {
+	long long at; // Monotonic milliseconds
+	long long timestamp; // Milliseconds since the epoch
+	double voltage;
+	double charge;
+	double load;
+} energy_sample;
+
+static volatile sig_atomic_t terminate = 0;
+
+static void stopenergy(int signal) {
+	terminate = 1;
+}
+
+// Sleeps until deadline on the monotonic clock, returning early when the
+// command is being terminated
+static void wait_sample(long long deadline) {
+	while (terminate == 0) {
+		long long remaining = deadline - monotonic_ms();
+		if (remaining <= 0) return;
+
+		struct timespec duration = {remaining / 1000, (remaining % 1000) * 1000000};
+		if (nanosleep(&duration, NULL) == 0) return;
+	}
+}
+
+static void set_totals(void *data, char *key, char *value) {
+	energy_totals *totals = data;
+	if (strcmp(key, "since") == 0) totals->since = strtoll(value, NULL, 10);
+	else if (strcmp(key, "updated") == 0) totals->updated = strtoll(value, NULL, 10);
+	else if (strcmp(key, "charge_ah") == 0) totals->charge_ah = strtod(value, NULL);
+	else if (strcmp(key, "charge_wh") == 0) totals->charge_wh = strtod(value, NULL);
+	else if (strcmp(key, "load_ah") == 0) totals->load_ah = strtod(value, NULL);
+	else if (strcmp(key, "load_wh") == 0) totals->load_wh = strtod(value, NULL);
+	else if (strcmp(key, "covered") == 0) totals->covered = strtod(value, NULL);
+	else if (strcmp(key, "gaps") == 0) totals->gaps = strtod(value, NULL);
+}
+
+// Missing state file starts totals from zero
+static int read_totals(char *path, energy_totals *totals) {
+	memset(totals, 0, sizeof(energy_totals));
+	totals->since = time(NULL);
+
+	if ((read_keys(path, set_totals, totals) == -1) && (errno != ENOENT)) {
+		fprintf(stderr, "Could not open energy state file '%s': %s.\n", path, strerror(errno));
+		return -1;
+	}
+
+	return 0;
+}
+
+// Replaces the state file atomically, so that totals survive the command
+// being killed while writing them
+static int write_totals(char *path, energy_totals *totals) {
+	char contents[ENERGY_SIZE];
+	snprintf(contents, sizeof(contents), "since=%lld\nupdated=%lld\ncharge_ah=%.4f\ncharge_wh=%.3f\nload_ah=%.4f\nload_wh=%.3f\ncovered=%.0f\ngaps=%.0f\n", totals->since, totals->updated, totals->charge_ah, totals->charge_wh, totals->load_ah, totals->load_wh, totals->covered, totals->gaps);
+	return replace_file(path, contents, "energy state file");
+}
+
+// Adds the area between two samples; samples further apart than ENERGY_GAP
+// intervals (failed reads, lock timeouts, the command not running) are
+// counted as a gap instead of guessing what happened in between
+static void integrate(energy_totals *totals, energy_sample *previous, energy_sample *current) {
+	double seconds = (current->at - previous->at) / 1000.0;
+	if (current->at - previous->at > ENERGY_GAP * interval * 1000LL) {
+		totals->gaps += seconds;
+		return;
+	}
+
+	double hours = seconds / 3600;
+	totals->charge_ah += (previous->charge + current->charge) / 2 * hours;
+	totals->load_ah += (previous->load + current->load) / 2 * hours;
+	totals->charge_wh += (previous->voltage * previous->charge + current->voltage * current->charge) / 2 * hours;
+	totals->load_wh += (previous->voltage * previous->load + current->voltage * current->load) / 2 * hours;
+	totals->covered += seconds;
+}
+
+// Samples every interval seconds, down to ENERGY_MIN_INTERVAL milliseconds
+// while currents change fast, where the trapezoidal rule would miss the most
+int pli_energy(solar_ctx *ctx) {
+	char *path = (state_file != NULL) ? state_file : DEFAULT_ENERGY_FILE;
+	energy_totals totals;
+	if (read_totals(path, &totals) == -1) return 2;
+
+	metric *metrics[] = {find_metric(pli_metrics, "batvoltage"), find_metric(pli_metrics, "charge"), find_metric(pli_metrics, "load")};
+
+	signal(SIGTERM, stopenergy);
+	signal(SIGINT, stopenergy);
+
+	long long slowest = interval * 1000LL;
+	long long fastest = (slowest < ENERGY_MIN_INTERVAL) ? slowest : ENERGY_MIN_INTERVAL;
+	long long step = slowest;
+	long long saved = monotonic_ms();
+	energy_sample previous;
+	int sampled = 0;
+
+	while (terminate == 0) {
+		long long start = monotonic_ms();
+
+		// Every sample reads fresh values
+		invalidate_cache(ctx);
+
+		double values[3];
+		read_metrics(ctx, metrics, 3, values);
+
+		// Display is not kept awake between samples
+		pli_finish(ctx);
+
+		if (!isnan(values[0]) && !isnan(values[1]) && !isnan(values[2])) {
+			energy_sample current = {start, realtime_ms(), values[0], values[1], values[2]};
+
+			if (sampled != 0) {
+				integrate(&totals, &previous, &current);
+
+				double change = fabs(current.charge - previous.charge) + fabs(current.load - previous.load);
+				if (change > ENERGY_CHANGE) step = (step / 2 < fastest) ? fastest : step / 2;
+				else if (change < ENERGY_CHANGE / 4) step = (step * 2 > slowest) ? slowest : step * 2;
+			}
+			// Time since the last sample of a previous run
+			else if ((totals.updated != 0) && (current.timestamp > totals.updated)) {
+				totals.gaps += (current.timestamp - totals.updated) / 1000.0;
+			}
+
+			totals.updated = current.timestamp;
+			previous = current;
+			sampled = 1;
+		}
+
+		if (monotonic_ms() - saved >= ENERGY_SAVE * 1000LL) {
+			write_totals(path, &totals);
+			saved = monotonic_ms();
+		}
+
+		wait_sample(start + step);
+	}
+
+	signal(SIGTERM, SIG_DFL);
+	signal(SIGINT, SIG_DFL);
+
+	if (write_totals(path, &totals) == -1) return 2;
+
+	return 0;
+}
@@ -0,0 +1,27 @@
+#ifndef ENERGY_H_
+#define ENERGY_H_
+
+#include "solar.h"
+
+#define DEFAULT_ENERGY_FILE "solar.energy"
+#define ENERGY_SIZE 512
+#define ENERGY_MIN_INTERVAL 1000 // Milliseconds between samples while currents change fast
+#define ENERGY_CHANGE 0.5 // Change of currents in A between samples which halves the interval
+#define ENERGY_GAP 3 // Samples further apart than this many intervals are not integrated
+#define ENERGY_SAVE 300 // Seconds between writes of the state file
+
+// Running totals, since the state file was created
+typedef struct {
+	double charge_ah;
+	double charge_wh;
+	double load_ah;
+	double load_wh;
+	double covered; // Seconds of integrated samples
+	double gaps; // Seconds without samples, which are not integrated
+	long long since; // Seconds since the epoch
+	long long updated; // Milliseconds since the epoch of the last integrated sample, 0 if none
+} energy_totals;
+
+int pli_energy(solar_ctx *ctx);
+
+#endif /* ENERGY_H_ */
@@ -0,0 +1,96 @@
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <errno.h>
+#include <unistd.h>
+#include <limits.h>
+#include <sys/stat.h>
+
+#include "files.h"
+
+// Files which are replaced atomically, so that their readers and interrupted
+// runs never see them partially written, and files of 'key=value' lines
+// Errors are reported with kind of the file in messages
+
+// Opens a temporary file next to path into which its new contents are
+// written
+FILE *open_replacement(char *path, char *temporary, int size, char *kind) {
+	if (snprintf(temporary, size, "%s.XXXXXX", path) >= size) {
+		fprintf(stderr, "Path of %s '%s' is too long.\n", kind, path);
+		return NULL;
+	}
+
+	int fd;
+	if ((fd = mkstemp(temporary)) == -1) {
+		fprintf(stderr, "Could not create %s '%s': %s.\n", kind, temporary, strerror(errno));
+		return NULL;
+	}
+
+	// Readers, like collectors, usually run as another user
+	FILE *file;
+	if ((fchmod(fd, 0644) == -1) || ((file = fdopen(fd, "w")) == NULL)) {
+		fprintf(stderr, "Could not create %s '%s': %s.\n", kind, temporary, strerror(errno));
+		close(fd);
+		unlink(temporary);
+		return NULL;
+	}
+
+	return file;
+}
+
+// Replaces path with the temporary file if keep is set, otherwise removes it
+// and leaves the previous file in place
+int close_replacement(FILE *file, char *path, char *temporary, int keep, char *kind) {
+	int failed = (fflush(file) == EOF) || (fsync(fileno(file)) == -1);
+	if (fclose(file) == EOF) failed = 1;
+	if (failed != 0) fprintf(stderr, "Could not write %s '%s': %s.\n", kind, temporary, strerror(errno));
+
+	if ((failed != 0) || (keep == 0)) {
+		unlink(temporary);
+		return (failed != 0) ? -1 : 0;
+	}
+
+	if (rename(temporary, path) == -1) {
+		fprintf(stderr, "Could not rename %s '%s' to '%s': %s.\n", kind, temporary, path, strerror(errno));
+		unlink(temporary);
+		return -1;
+	}
+
+	return 0;
+}
+
+// Replaces path with a file with contents
+int replace_file(char *path, char *contents, char *kind) {
+	char temporary[PATH_MAX];
+	FILE *file;
+	if ((file = open_replacement(path, temporary, sizeof(temporary), kind)) == NULL) return -1;
+
+	if (fputs(contents, file) == EOF) {
+		fprintf(stderr, "Could not write %s '%s': %s.\n", kind, temporary, strerror(errno));
+		close_replacement(file, path, temporary, 0, kind);
+		return -1;
+	}
+
+	return close_replacement(file, path, temporary, 1, kind);
+}
+
+// Calls set for every 'key=value' line, other lines are skipped
+// Returns -1 with errno set if the file could not be opened
+int read_keys(char *path, void (*set)(void *data, char *key, char *value), void *data) {
+	FILE *file;
+	if ((file = fopen(path, "r")) == NULL) return -1;
+
+	char line[FILES_LINE];
+	while (fgets(line, sizeof(line), file) != NULL) {
+		line[strcspn(line, "\n")] = '\0';
+
+		char *value = strchr(line, '=');
+		if (value == NULL) continue;
+		*value++ = '\0';
+
+		set(data, line, value);
+	}
+	fclose(file);
+
+	return 0;
+}
@@ -0,0 +1,13 @@
+#ifndef FILES_H_
+#define FILES_H_
+
+#include <stdio.h>
+
+#define FILES_LINE 256 // Longest 'key=value' line
+
+FILE *open_replacement(char *path, char *temporary, int size, char *kind);
+int close_replacement(FILE *file, char *path, char *temporary, int keep, char *kind);
+int replace_file(char *path, char *contents, char *kind);
+int read_keys(char *path, void (*set)(void *data, char *key, char *value), void *data);
+
+#endif /* FILES_H_ */
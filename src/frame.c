@@ -0,0 +1,72 @@
+#include <string.h>
+
+#include "frame.h"
+
+// Encoding of PLI requests and decoding of replies to them, so that frames
+// are built and checked in one place
+
+void encode_request(unsigned char frame[], unsigned char op, unsigned char location, unsigned char data) {
+	frame[0] = op;
+	frame[1] = location;
+	frame[2] = data;
+	frame[3] = op ^ 0xFF;
+}
+
+// Checksum of a request is its inverted op
+int request_valid(unsigned char frame[]) {
+	return (frame[0] ^ 0xFF) == frame[3];
+}
+
+// Expected size of a successful reply to a request with op, 0 if PLI does not
+// reply to it
+int reply_size(unsigned char op) {
+	switch (op) {
+		case OP_READ_PROCESSOR:
+		case OP_READ_EEPROM:
+			return 2;
+		case OP_LOOPBACK:
+			return 1;
+		default:
+			return 0;
+	}
+}
+
+// Replies never start with a request byte, so one which does is an echo, and
+// a success code is valid only if the request has such a reply
+int reply_kind(unsigned char request[], unsigned char first) {
+	if (first == request[0]) return REPLY_ECHO;
+	if ((first >= CODE_ERROR_FIRST) && (first <= CODE_ERROR_LAST)) return REPLY_ERROR;
+	if ((first == CODE_DATA) && (reply_size(request[0]) == 2)) return REPLY_DATA;
+	if ((first == CODE_ACK) && (reply_size(request[0]) == 1)) return REPLY_ACK;
+	return REPLY_INVALID;
+}
+
+// Number of bytes of a reply of kind, 0 if it is invalid
+int reply_length(int kind) {
+	switch (kind) {
+		case REPLY_ECHO:
+			return FRAME_SIZE;
+		case REPLY_DATA:
+			return 2;
+		case REPLY_ACK:
+		case REPLY_ERROR:
+			return 1;
+		default:
+			return 0;
+	}
+}
+
+// Decodes a complete reply to request, which has to be exactly length bytes
+// long; echoes have to match the request
+// Returns -1 if data is not such a reply
+int decode_reply(unsigned char request[], unsigned char data[], int length, pli_reply *reply) {
+	reply->kind = reply_kind(request, data[0]);
+	reply->code = data[0];
+	reply->value = 0;
+
+	if ((reply->kind == REPLY_INVALID) || (length != reply_length(reply->kind))) return -1;
+	if ((reply->kind == REPLY_ECHO) && ((memcmp(data, request, FRAME_SIZE) != 0) || !request_valid(data))) return -1;
+	if (reply->kind == REPLY_DATA) reply->value = data[1];
+
+	return 0;
+}
@@ -0,0 +1,42 @@
+#ifndef FRAME_H_
+#define FRAME_H_
+
+#define FRAME_SIZE 4 // Of requests: op, location, data and op ^ 0xFF as a checksum
+#define REPLY_MAX 2
+
+#define OP_READ_PROCESSOR 0x14
+#define OP_READ_EEPROM 0x48
+#define OP_WRITE_PROCESSOR 0x98
+#define OP_WRITE_EEPROM 0xCA
+#define OP_PUSH 0x57
+#define OP_LOOPBACK 0xBB
+#define PUSH_SHORT 0x01
+#define PUSH_LONG 0x02
+
+#define CODE_DATA 0xC8 // Followed by the value read
+#define CODE_ACK 0x80
+#define CODE_ERROR_FIRST 0x81
+#define CODE_ERROR_LAST 0x86
+
+// Kinds of replies, by their first byte
+#define REPLY_INVALID 0
+#define REPLY_ECHO 1 // Request sent back by PLI while data from the regulator is not ready
+#define REPLY_DATA 2
+#define REPLY_ACK 3
+#define REPLY_ERROR 4 // Single byte error code
+
+// A decoded reply to a request
+typedef struct {
+	int kind; // REPLY_*
+	unsigned char code; // First byte
+	unsigned char value; // Of REPLY_DATA replies
+} pli_reply;
+
+void encode_request(unsigned char frame[], unsigned char op, unsigned char location, unsigned char data);
+int request_valid(unsigned char frame[]);
+int reply_size(unsigned char op);
+int reply_kind(unsigned char request[], unsigned char first);
+int reply_length(int kind);
+int decode_reply(unsigned char request[], unsigned char data[], int length, pli_reply *reply);
+
+#endif /* FRAME_H_ */
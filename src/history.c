@@ -0,0 +1,175 @@
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <errno.h>
+#include <time.h>
+
+#include "history.h"
+#include "main.h"
+#include "pli.h"
+#include "protocol.h"
+#include "clocksync.h"
+#include "files.h"
+
+// Downloads days from the regulator's daily log which ended since the last
+// download, remembered in a state file, so that a daily run reads just a
+// few registers instead of the whole log
+
+static unsigned char history_fields[HISTORY_FIELDS] = {HISTORY_VBMIN, HISTORY_VBMAX, HISTORY_AHIN, HISTORY_AHOUT};
+
+// Local date at noon, so that day arithmetic is not affected by daylight
+// saving time changes
+static time_t local_date(int year, int month, int day) {
+	struct tm date;
+	memset(&date, 0, sizeof(date));
+	date.tm_year = year - 1900;
+	date.tm_mon = month - 1;
+	date.tm_mday = day;
+	date.tm_hour = 12;
+	date.tm_isdst = -1;
+	return mktime(&date);
+}
+
+static void format_date(time_t date, char *buffer) {
+	struct tm local;
+	localtime_r(&date, &local);
+	strftime(buffer, HISTORY_DATE, "%Y-%m-%d", &local);
+}
+
+static void set_state(void *data, char *key, char *value) {
+	if (strcmp(key, "last") == 0) snprintf(data, HISTORY_DATE, "%s", value);
+}
+
+// Returns date of the last downloaded day, 0 if there is none
+static time_t read_state(char *path) {
+	char last[HISTORY_DATE] = "";
+	if (read_keys(path, set_state, last) == -1) {
+		if (errno != ENOENT) fprintf(stderr, "Could not open history state file '%s': %s.\n", path, strerror(errno));
+		return 0;
+	}
+
+	int year;
+	int month;
+	int day;
+	if (sscanf(last, "%d-%d-%d", &year, &month, &day) != 3) {
+		fprintf(stderr, "Invalid history state file '%s', downloading all days.\n", path);
+		return 0;
+	}
+	return local_date(year, month, day);
+}
+
+// Replaces the state file atomically, so that an interrupted run does not
+// lose it
+static int write_state(char *path, char *date) {
+	char contents[32];
+	snprintf(contents, sizeof(contents), "last=%s\n", date);
+	return replace_file(path, contents, "history state file");
+}
+
+// Regulator's date is today or yesterday on this system, as they can switch
+// days at a slightly different time; any other day means that its clock is
+// not set
+// Its day register counts days in a month from 0, as set by setdaytime
+static time_t regulator_date(solar_ctx *ctx) {
+	int day;
+	if ((day = read_processor(ctx, CLOCK_DAY)) == -1) return -1;
+	day++;
+
+	time_t now = time(NULL);
+	struct tm local;
+	localtime_r(&now, &local);
+	time_t today = local_date(local.tm_year + 1900, local.tm_mon + 1, local.tm_mday);
+	if (local.tm_mday == day) return today;
+
+	time_t yesterday = today - 24 * 60 * 60;
+	localtime_r(&yesterday, &local);
+	if (local.tm_mday == day) return yesterday;
+
+	fprintf(stderr, "Regulator day %d does not match the date of this system, set it with 'syncclock' command.\n", day);
+	return -1;
+}
+
+static void print_days(history_day *days, int count) {
+	int i;
+	switch (output_format) {
+		case FORMAT_CSV:
+			fprintf(out, "date,vbmin,vbmax,ahin,ahout\n");
+			for (i = 0; i < count; i++) {
+				fprintf(out, "%s,%.1f,%.1f,%.0f,%.0f\n", days[i].date, days[i].vbmin, days[i].vbmax, days[i].ahin, days[i].ahout);
+			}
+			break;
+		case FORMAT_JSON:
+			fprintf(out, "[");
+			for (i = 0; i < count; i++) {
+				fprintf(out, "%s\n  {\"date\": \"%s\", \"vbmin\": %.1f, \"vbmax\": %.1f, \"ahin\": %.0f, \"ahout\": %.0f}", (i > 0) ? "," : "", days[i].date, days[i].vbmin, days[i].vbmax, days[i].ahin, days[i].ahout);
+			}
+			fprintf(out, "%s]\n", (count > 0) ? "\n" : "");
+			break;
+		default:
+			for (i = 0; i < count; i++) {
+				if (plain_output != 0) fprintf(out, "%s %.1f %.1f %.0f %.0f\n", days[i].date, days[i].vbmin, days[i].vbmax, days[i].ahin, days[i].ahout);
+				else fprintf(out, "%s: battery %.1f-%.1f V, %.0f Ah in, %.0f Ah out\n", days[i].date, days[i].vbmin, days[i].vbmax, days[i].ahin, days[i].ahout);
+			}
+			break;
+	}
+}
+
+int pli_history(solar_ctx *ctx) {
+	if (output_format == FORMAT_PROM) {
+		fprintf(stderr, "Output format 'prom' is not supported by 'history' command.\n");
+		return 1;
+	}
+
+	char *path = (state_file != NULL) ? state_file : DEFAULT_HISTORY_FILE;
+	time_t last = read_state(path);
+
+	time_t today;
+	if ((today = regulator_date(ctx)) == -1) return 3;
+
+	// Today has not ended yet and the log keeps only so many days
+	int count = (last == 0) ? (HISTORY_DAYS - 1) : (int)((today - last + 12 * 60 * 60) / (24 * 60 * 60)) - 1;
+	if (count > HISTORY_DAYS - 1) count = HISTORY_DAYS - 1;
+	history_day days[HISTORY_DAYS];
+	if (count <= 0) {
+		print_days(days, 0);
+		return 0;
+	}
+
+	// Registers of all days are read in one exchange
+	unsigned char locations[HISTORY_FIELDS * HISTORY_DAYS + 1];
+	int n = 0;
+	int i;
+	int j;
+	locations[n++] = 0x20;
+	for (i = 1; i <= count; i++) {
+		for (j = 0; j < HISTORY_FIELDS; j++) {
+			locations[n++] = history_fields[j] + i;
+		}
+	}
+	if (prefetch_processor(ctx, locations, n) == -1) return 3;
+
+	int range;
+	if ((range = read_processor(ctx, 0x20)) == -1) return 3;
+
+	// Oldest day first
+	for (i = 0; i < count; i++) {
+		int ago = count - i;
+		int values[HISTORY_FIELDS];
+		for (j = 0; j < HISTORY_FIELDS; j++) {
+			if ((values[j] = read_processor(ctx, history_fields[j] + ago)) == -1) return 3;
+		}
+
+		format_date(today - ago * 24 * 60 * 60, days[i].date);
+		days[i].vbmin = values[0] * (range + 1) * 0.1;
+		days[i].vbmax = values[1] * (range + 1) * 0.1;
+		days[i].ahin = values[2];
+		days[i].ahout = values[3];
+	}
+
+	print_days(days, count);
+	fflush(out);
+
+	if (write_state(path, days[count - 1].date) == -1) return 2;
+
+	return 0;
+}
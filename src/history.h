@@ -0,0 +1,29 @@
+#ifndef HISTORY_H_
+#define HISTORY_H_
+
+#include "solar.h"
+
+#define DEFAULT_HISTORY_FILE "solar.history"
+
+// Regulator keeps a log of the last HISTORY_DAYS days in processor memory, one
+// register per day for every field, starting with today
+#define HISTORY_DAYS 24
+#define HISTORY_VBMIN 0x68 // Minimum battery voltage, in units of the battery voltage register
+#define HISTORY_VBMAX 0x80 // Maximum battery voltage
+#define HISTORY_AHIN 0x98 // Charge in Ah
+#define HISTORY_AHOUT 0xB0 // Load in Ah
+#define HISTORY_FIELDS 4
+#define HISTORY_DATE 11 // 'YYYY-MM-DD' with terminating null character
+
+// Log of a day which has already ended
+typedef struct {
+	char date[HISTORY_DATE];
+	double vbmin;
+	double vbmax;
+	double ahin;
+	double ahout;
+} history_day;
+
+int pli_history(solar_ctx *ctx);
+
+#endif /* HISTORY_H_ */
@@ -6,59 +6,179 @@
 #include <unistd.h>
 #include <signal.h>
 #include <termios.h>
+#include <limits.h>
+#include <time.h>
 
 #include "main.h"
 #include "pli.h"
+#include "dump.h"
+#include "protocol.h"
+#include "serial.h"
+#include "daemon.h"
+#include "snapshot.h"
+#include "ringlog.h"
+#include "multi.h"
+#include "output.h"
+#include "files.h"
+#include "profile.h"
+#include "history.h"
+#include "energy.h"
 
 char *device = DEFAULT_DEVICE_FILE;
 speed_t baud = DEFAULT_BAUD;
+char *devices = NULL;
+FILE *out;
 int plain_output = 0;
+int reply_timeout = DEFAULT_REPLY_TIMEOUT;
+int lock_timeout = DEFAULT_LOCK_TIMEOUT;
+int pipeline_depth = DEFAULT_PIPELINE_DEPTH;
+int cache_maxage = -1;
+char *socket_path = NULL;
+int use_snapshot = 0;
+int interval = DEFAULT_INTERVAL;
+char *log_file = DEFAULT_LOG_FILE;
+int log_records = DEFAULT_LOG_RECORDS;
+// By default registers behind batvoltage, charge, load and state commands are logged
+unsigned char registers[RINGLOG_REGISTERS] = {0x20, 0x32, 0xD5, 0xCD, 0xCF, 0xD9, 0xCE, 0x65};
+int registers_count = 8;
+int log_layout_given = 0; // -n or -r, which an existing log file has to match
+int output_format = FORMAT_TEXT;
+char *dump_file = NULL;
+int hex_output = 0;
+char *since_file = NULL;
+char *profile_file = NULL;
+char *state_file = NULL;
+char *hook_command = NULL;
+int print_stats = 0;
+char *stats_file = NULL;
+char *textfile_path = NULL;
+char **arguments = NULL;
+int arguments_count = 0;
 interface *iface;
 
+command builtin_commands[] = {
+	{"help", "display this help", help},
+	{"version", "display version of this program", version},
+	{"daemon", "serve commands to clients over a Unix domain socket", run_daemon, 0, COMMAND_ENDLESS},
+	{"dump-log", "output records from the ring buffer log file", dump_log},
+	{NULL, NULL}
+};
+
 interface interfaces[] = {
-	{"pli", pli_commands},
+	{"pli", pli_commands, pli_finish},
 	{NULL, NULL}
 };
 
-int help(int fd) {
-	if ((plain_output != 0) && (iface->name != NULL)) {
-		fprintf(stdout, "help\n");
-		fprintf(stdout, "version\n");
+// Outputs flags of a command as CSV columns, so that tools like solarbench
+// can choose which commands to run
+static void printcommand(command *j, int builtin) {
+	fprintf(out, "%s,%d,%d,%d,%d,%d\n", j->name, builtin, j->arguments, (j->flags & COMMAND_ENDLESS) != 0, (j->flags & COMMAND_CHANGES) != 0, (j->flags & COMMAND_FILES) != 0);
+}
+
+int help(solar_ctx *ctx) {
+	if ((output_format == FORMAT_CSV) && (iface->name != NULL)) {
 		command *j;
+		fprintf(out, "name,builtin,arguments,endless,changes,files\n");
+		for (j = builtin_commands; j->name != NULL; j++) {
+			printcommand(j, 1);
+		}
 		for (j = iface->commands; j->name != NULL; j++) {
-			fprintf(stdout, "%s\n", j->name);
+			printcommand(j, 0);
+		}
+	}
+	else if ((plain_output != 0) && (iface->name != NULL)) {
+		command *j;
+		for (j = builtin_commands; j->name != NULL; j++) {
+			fprintf(out, "%s\n", j->name);
+		}
+		for (j = iface->commands; j->name != NULL; j++) {
+			fprintf(out, "%s\n", j->name);
 		}
 	}
 	else {
-		printhelp(stdout);
+		printhelp(out);
 	}
 	return 0;
 }
 
-int version(int fd) {
-	fprintf(stdout, "%s%s\n", ((plain_output != 0) ? "" : "Version: "), VERSION);
+int version(solar_ctx *ctx) {
+	fprintf(out, "%s%s\n", ((plain_output != 0) ? "" : "Version: "), VERSION);
 	return 0;
 }
 
 void printhelp(FILE *output) {
-	fprintf(output, "solar[.<iface>] [-p] [-d <device>] [-b <baud>] <command>\n");
-	fprintf(output, "  -p           plain (just values) output\n");
-	fprintf(output, "  -d <device>  use <device> as a serial port device file (default: %s)\n", DEFAULT_DEVICE_FILE);
-	fprintf(output, "  -b <baud>    communicate with <baud> baud over a serial port (default: %d)\n", DEFAULT_BAUD_NAME);
+	fprintf(output, "solar[.<iface>] [-p] [-s] [-d <device>] [-D <devices>] [-b <baud>] [-t <timeout>] [-w <timeout>] [-q <depth>] [-u <socket>] [-m <maxage>] [-i <interval>]\n");
+	fprintf(output, "                [-l <file>] [-n <records>] [-r <registers>] [-o <format>]\n");
+	fprintf(output, "                [-f <file>] [-x] [--since <file>] [--textfile <file>] [--stats] [--stats-file <file>]\n");
+	fprintf(output, "                [--profile <file>] [--state <file>] [--hook <script>]\n");
+	fprintf(output, "                <command>...\n");
+	fprintf(output, "  -p             plain (just values) output\n");
+	fprintf(output, "  -s             read values from shared memory snapshot written by 'sample' or\n");
+	fprintf(output, "                 'schedule' command\n");
+	fprintf(output, "  -d <device>    use <device> as a serial port device file (default: %s)\n", DEFAULT_DEVICE_FILE);
+	fprintf(output, "  -D <devices>   read values from all regulators in a comma separated list of\n");
+	fprintf(output, "                 <device>[:<baud>] at once, prefixing output with the device\n");
+	fprintf(output, "  -b <baud>      communicate with <baud> baud over a serial port (default: found by\n");
+	fprintf(output, "                 'probe' command or %d)\n", DEFAULT_BAUD_NAME);
+	fprintf(output, "  -t <timeout>   wait at most <timeout> milliseconds for a command and response (default: %d)\n", DEFAULT_REPLY_TIMEOUT);
+	fprintf(output, "  -w <timeout>   wait at most <timeout> milliseconds for serial port lock (default: %d)\n", DEFAULT_LOCK_TIMEOUT);
+	fprintf(output, "  -q <depth>     send up to <depth> commands before reading responses, falling back\n");
+	fprintf(output, "                 to one at a time if PLI does not keep up (default: %d, max: %d)\n", DEFAULT_PIPELINE_DEPTH, PIPELINE_MAX);
+	fprintf(output, "  -u <socket>    send commands to a daemon listening on <socket> or listen on it when\n");
+	fprintf(output, "                 running as a daemon (default: %s)\n", DEFAULT_SOCKET);
+	fprintf(output, "  -m <maxage>    use register values read at most <maxage> milliseconds ago (default:\n");
+	fprintf(output, "                 whole session, %d when running as a daemon)\n", DEFAULT_CACHE_MAXAGE);
+	fprintf(output, "  -i <interval>  sample values every <interval> seconds (default: %d)\n", DEFAULT_INTERVAL);
+	fprintf(output, "  -l <file>      log samples into ring buffer log <file> (default: %s)\n", DEFAULT_LOG_FILE);
+	fprintf(output, "  -n <records>   create ring buffer log with space for <records> samples (default: %d)\n", DEFAULT_LOG_RECORDS);
+	fprintf(output, "  -r <registers> create ring buffer log with samples of <registers> (default: registers\n");
+	fprintf(output, "                 of batvoltage, charge, load and state commands)\n");
+	fprintf(output, "  -o <format>    output in <format> (default: text, possible: text csv json prom)\n");
+	fprintf(output, "  -f <file>      dump memory into <file> (default: solar.ram or solar.eeprom)\n");
+	fprintf(output, "  -x             output dumped memory in hexadecimal\n");
+	fprintf(output, "  --since <file> output only bytes of dumped memory changed since dump in <file>\n");
+	fprintf(output, "  --textfile <file>\n");
+	fprintf(output, "                 write output into <file> atomically, replacing it only if all commands\n");
+	fprintf(output, "                 succeed (for example for node_exporter textfile collector)\n");
+	fprintf(output, "  --stats        output serial port and transport statistics of the session to standard\n");
+	fprintf(output, "                 error\n");
+	fprintf(output, "  --stats-file <file>\n");
+	fprintf(output, "                 append statistics of the session as a line to <file>\n");
+	fprintf(output, "  --profile <file>\n");
+	fprintf(output, "                 store link profile found by 'probe' command in <file> (default: a file\n");
+	fprintf(output, "                 named after the device in %s)\n", PROFILE_DIR);
+	fprintf(output, "  --state <file> remember the last day downloaded by 'history' command or totals of\n");
+	fprintf(output, "                 'energy' command in <file> (default: %s or %s)\n", DEFAULT_HISTORY_FILE, DEFAULT_ENERGY_FILE);
+	fprintf(output, "  --hook <script>\n");
+	fprintf(output, "                 run shell <script> for every event output by 'watch' command, with\n");
+	fprintf(output, "                 SOLAR_EVENT, SOLAR_METRIC, SOLAR_VALUE, SOLAR_PREVIOUS and\n");
+	fprintf(output, "                 SOLAR_THRESHOLD environment variables set\n");
 	fprintf(output, "\n");
-	fprintf(output, "  <iface>    which interface to use (default: %s, possible:", DEFAULT_INTERFACE);
+	fprintf(output, "  <iface>     which interface to use (default: %s, possible:", DEFAULT_INTERFACE);
 	interface *i;
 	for (i = interfaces; i->name != NULL; i++) {
 		fprintf(output, " %s", i->name);
 	}
 	fprintf(output, ")\n");
-	fprintf(output, "  <baud>     baud of communication over a serial port (integer)\n");
-	fprintf(output, "  <device>   path to a serial port device file\n");
+	fprintf(output, "  <baud>      baud of communication over a serial port (integer)\n");
+	fprintf(output, "  <device>    path to a serial port device file\n");
+	fprintf(output, "  <timeout>   timeout in milliseconds (integer)\n");
+	fprintf(output, "  <depth>     number of commands (integer)\n");
+	fprintf(output, "  <socket>    path to a Unix domain socket\n");
+	fprintf(output, "  <maxage>    age in milliseconds (integer)\n");
+	fprintf(output, "  <interval>  interval in seconds (integer)\n");
+	fprintf(output, "  <file>      path to a file\n");
+	fprintf(output, "  <records>   number of records (integer)\n");
+	fprintf(output, "  <registers> comma separated list of at most %d register addresses (integers)\n", RINGLOG_REGISTERS);
+	fprintf(output, "  <format>    output format\n");
+	fprintf(output, "  <script>    shell command\n");
 	if (iface->name == NULL) {
-		fprintf(output, "  <command>  command of interface to execute (possible commands bellow)\n");
+		fprintf(output, "  <command>   command of interface to execute, more can be given to be executed\n");
+		fprintf(output, "              in order in one session (possible commands bellow)\n");
 	}
 	else {
-		fprintf(output, "  <command>  command of '%s' interface to execute (possible commands bellow)\n", iface->name);
+		fprintf(output, "  <command>   command of '%s' interface to execute, more can be given to be executed\n", iface->name);
+		fprintf(output, "              in order in one session (possible commands bellow)\n");
 	}
 	int maxname = 7;
 	if (iface->name != NULL) {
@@ -70,6 +190,8 @@ void printhelp(FILE *output) {
 	fprintf(output, "\n");
 	fprintf(output, "  %-*s  %s\n", maxname, "help", "display this help");
 	fprintf(output, "  %-*s  %s %s\n", maxname, "version", "display version of this program, that is", VERSION);
+	fprintf(output, "  %-*s  %s\n", maxname, "daemon", "serve commands to clients over a Unix domain socket");
+	fprintf(output, "  %-*s  %s\n", maxname, "dump-log", "output records from the ring buffer log file");
 	if (iface->name != NULL) {
 		command *j;
 		for (j = iface->commands; j->name != NULL; j++) {
@@ -78,47 +200,108 @@ void printhelp(FILE *output) {
 	}
 }
 
-void lockwait(int signal) {
-	fprintf(stderr, "Timeout while waiting for serial port device file '%s'.\n", device);
-	exit(2);
+command *findcommand(command *commands, char *name) {
+	command *j;
+	for (j = commands; j->name != NULL; j++) {
+		if (strcmp(j->name, name) == 0) return j;
+	}
+	return NULL;
 }
 
-int openserialport() {
-	int fd;
-	struct termios params;
+// Outputs transport statistics, the first line is parsed by solarbench
+static void printstats(serial_counters *stats) {
+	int i;
+	fprintf(stderr, "Statistics: %lld transactions, %lld bytes written, %lld bytes read, %lld ms waiting for lock, %lld ms holding lock.\n", stats->written / FRAME_SIZE, stats->written, stats->read, stats->lock_wait, stats->lock_held);
+	fprintf(stderr, "Transport: %lld echoes, %lld partial reads, %lld timeouts, %lld retries, %lld pipeline fallbacks, %lld recoveries.\n", stats->echoes, stats->partial_reads, stats->timeouts, stats->retries, stats->fallbacks, stats->recoveries);
 
-	// We have to use O_NONBLOCK because otherwise open blocks if serial port is not yet connected
-	if ((fd = open(device, O_RDWR | O_NOCTTY | O_NONBLOCK)) == -1) return -1;
-	if (fcntl(fd, F_SETFL, 0) == -1) return -1; // We clear O_NONBLOCK
-	if (tcgetattr(fd, &params) == -1) return -1;
+	fprintf(stderr, "Error codes:");
+	for (i = 0; i < ERROR_CODES - 1; i++) {
+		fprintf(stderr, " 0x%02X %lld,", 0x81 + i, stats->errors[i]);
+	}
+	fprintf(stderr, " other %lld.\n", stats->errors[ERROR_CODES - 1]);
 
-	cfmakeraw(&params);
-	cfsetspeed(&params, baud);
+	long long responses = 0;
+	fprintf(stderr, "Latency (ms):");
+	for (i = 0; i < LATENCY_BUCKETS - 1; i++) {
+		fprintf(stderr, " <=%lld %lld,", latency_bounds[i], stats->latency[i]);
+		responses += stats->latency[i];
+	}
+	responses += stats->latency[LATENCY_BUCKETS - 1];
+	fprintf(stderr, " >%lld %lld, mean %.1f, max %lld.\n", latency_bounds[LATENCY_BUCKETS - 2], stats->latency[LATENCY_BUCKETS - 1], (responses > 0) ? (double)stats->latency_sum / responses : 0.0, stats->latency_max);
+}
 
-	// 8 bit data, one stop bit, RTS/CTS flow control
-	params.c_cflag = CLOCAL | CREAD | CS8 | HUPCL | CRTSCTS;
+// Appends transport statistics of this run as one line of key=value pairs, so
+// that they can be aggregated across runs
+static void appendstats(char *path, int status, serial_counters *stats) {
+	char line[STATS_LINE];
+	int length = 0;
+	int i;
 
-	if (tcsetattr(fd, TCSANOW, &params) == -1) return -1;
+#define APPEND(...) length += snprintf(line + length, (length < sizeof(line)) ? sizeof(line) - length : 0, __VA_ARGS__)
+	APPEND("time=%ld device=%s status=%d", (long)time(NULL), (devices != NULL) ? devices : device, status);
+	APPEND(" transactions=%lld written=%lld read=%lld", stats->written / FRAME_SIZE, stats->written, stats->read);
+	APPEND(" lock_wait=%lld lock_held=%lld", stats->lock_wait, stats->lock_held);
+	APPEND(" echoes=%lld partial_reads=%lld timeouts=%lld retries=%lld fallbacks=%lld recoveries=%lld", stats->echoes, stats->partial_reads, stats->timeouts, stats->retries, stats->fallbacks, stats->recoveries);
+	for (i = 0; i < ERROR_CODES - 1; i++) {
+		APPEND(" error_%02x=%lld", 0x81 + i, stats->errors[i]);
+	}
+	APPEND(" error_other=%lld", stats->errors[ERROR_CODES - 1]);
+	for (i = 0; i < LATENCY_BUCKETS - 1; i++) {
+		APPEND(" latency_le_%lld=%lld", latency_bounds[i], stats->latency[i]);
+	}
+	APPEND(" latency_inf=%lld latency_sum=%lld latency_max=%lld\n", stats->latency[LATENCY_BUCKETS - 1], stats->latency_sum, stats->latency_max);
+#undef APPEND
 
-	// Will wait IO_WAIT seconds for the lock
-	alarm(IO_WAIT);
+	if (length >= sizeof(line)) {
+		fprintf(stderr, "Statistics line is too long.\n");
+		return;
+	}
 
-	if (flock(fd, LOCK_EX) == -1) {
-		int e = errno;
+	// One write with O_APPEND keeps lines of concurrent runs whole
+	int file;
+	if ((file = open(path, O_WRONLY | O_CREAT | O_APPEND, 0644)) == -1) {
+		fprintf(stderr, "Could not open statistics file '%s': %s.\n", path, strerror(errno));
+		return;
+	}
+	if (write(file, line, length) != length) {
+		fprintf(stderr, "Could not write statistics file '%s': %s.\n", path, strerror(errno));
+	}
+	close(file);
+}
 
-		// Disables alarm
-		alarm(0);
+// Executes commands in order in one serial port session
+static int run_batch(solar_ctx *session, command **batch, int count, int needsport) {
+	if ((needsport != 0) && (open_session(session, device, baud, lock_timeout) == -1)) {
+		if (errno == ETIMEDOUT) {
+			fprintf(stderr, "Timeout while waiting for serial port device file '%s'.\n", device);
+		}
+		else fprintf(stderr, "Could not open serial port device file '%s': %s.\n", device, strerror(errno));
+		return 2;
+	}
 
-		return e;
+	// Stops at the first failed command so that plain output lines still match
+	// the order of given commands
+	int ret = 0;
+	int i;
+	for (i = 0; (i < count) && (ret == 0); i++) {
+		ret = batch[i]->function(session);
 	}
 
-	// Disables alarm
-	alarm(0);
+	if ((needsport != 0) && (iface->finish != NULL) && (iface->finish(session) != 0) && (ret == 0)) ret = 3;
+
+	if (needsport != 0) session->stats.lock_held = monotonic_ms() - session->stats.locked_at;
+
+	if ((needsport != 0) && (close(session->fd) == -1)) {
+		fprintf(stderr, "Could not close serial port device file '%s': %s.\n", device, strerror(errno));
+		return 2;
+	}
 
-	return fd;
+	return ret;
 }
 
 int main(int argc, char *argv[]) {
+	out = stdout;
+
 	// Gets the extension of the program filename
 	char *iname = strrchr(argv[0], '/');
 	if (iname == NULL) iname = argv[0];
@@ -135,9 +318,15 @@ int main(int argc, char *argv[]) {
 		return 1;
 	}
 
-	signal(SIGALRM, lockwait); // If we get SIGALRM this probably means that we timeout on lock
-
-	int (*c)(int fd) = NULL;
+	// Commands are executed in the given order in one serial port session
+	command **batch = calloc(argc, sizeof(command *));
+	if (batch == NULL) {
+		fprintf(stderr, "Could not allocate memory: %s.\n", strerror(errno));
+		return 2;
+	}
+	int count = 0;
+	int needsport = 0;
+	int baud_given = 0;
 
 	int i;
 	for (i = 1; i < argc; i++) {
@@ -152,9 +341,191 @@ int main(int argc, char *argv[]) {
 				return 1;
 			}
 		}
+		else if (strcmp(argv[i], "-D") == 0) {
+			i++;
+			if ((i < argc) && (argv[i][0] != '\0')) {
+				devices = argv[i];
+			}
+			else {
+				fprintf(stderr, "Missing parameter for -D argument.\n\n");
+				printhelp(stderr);
+				return 1;
+			}
+		}
 		else if (strcmp(argv[i], "-p") == 0) {
 			plain_output = 1;
 		}
+		else if (strcmp(argv[i], "-s") == 0) {
+			use_snapshot = 1;
+		}
+		else if (strcmp(argv[i], "-i") == 0) {
+			i++;
+			if ((i < argc) && (argv[i][0] != '\0')) {
+				char *end;
+				interval = strtol(argv[i], &end, 10);
+				if ((*end != '\0') || (interval <= 0)) {
+					fprintf(stderr, "Invalid parameter '%s' for -i argument.\n\n", argv[i]);
+					printhelp(stderr);
+					return 1;
+				}
+			}
+			else {
+				fprintf(stderr, "Missing parameter for -i argument.\n\n");
+				printhelp(stderr);
+				return 1;
+			}
+		}
+		else if (strcmp(argv[i], "-l") == 0) {
+			i++;
+			if ((i < argc) && (argv[i][0] != '\0')) {
+				log_file = argv[i];
+			}
+			else {
+				fprintf(stderr, "Missing parameter for -l argument.\n\n");
+				printhelp(stderr);
+				return 1;
+			}
+		}
+		else if (strcmp(argv[i], "-n") == 0) {
+			i++;
+			if ((i < argc) && (argv[i][0] != '\0')) {
+				char *end;
+				log_records = strtol(argv[i], &end, 10);
+				if ((*end != '\0') || (log_records <= 0)) {
+					fprintf(stderr, "Invalid parameter '%s' for -n argument.\n\n", argv[i]);
+					printhelp(stderr);
+					return 1;
+				}
+				log_layout_given = 1;
+			}
+			else {
+				fprintf(stderr, "Missing parameter for -n argument.\n\n");
+				printhelp(stderr);
+				return 1;
+			}
+		}
+		else if (strcmp(argv[i], "-r") == 0) {
+			i++;
+			if ((i < argc) && (argv[i][0] != '\0')) {
+				char *end = argv[i];
+				registers_count = 0;
+				do {
+					char *start = (*end == ',') ? end + 1 : end;
+					int r = strtol(start, &end, 0);
+					if ((end == start) || ((*end != ',') && (*end != '\0')) || (r < 0) || (r > 0xFF) || (registers_count == RINGLOG_REGISTERS)) {
+						fprintf(stderr, "Invalid parameter '%s' for -r argument.\n\n", argv[i]);
+						printhelp(stderr);
+						return 1;
+					}
+					registers[registers_count++] = r;
+				} while (*end != '\0');
+				log_layout_given = 1;
+			}
+			else {
+				fprintf(stderr, "Missing parameter for -r argument.\n\n");
+				printhelp(stderr);
+				return 1;
+			}
+		}
+		else if (strcmp(argv[i], "-o") == 0) {
+			i++;
+			if ((i < argc) && (parse_format(argv[i]) != -1)) {
+				output_format = parse_format(argv[i]);
+			}
+			else if (i < argc) {
+				fprintf(stderr, "Invalid parameter '%s' for -o argument.\n\n", argv[i]);
+				printhelp(stderr);
+				return 1;
+			}
+			else {
+				fprintf(stderr, "Missing parameter for -o argument.\n\n");
+				printhelp(stderr);
+				return 1;
+			}
+		}
+		else if (strcmp(argv[i], "-f") == 0) {
+			i++;
+			if ((i < argc) && (argv[i][0] != '\0')) {
+				dump_file = argv[i];
+			}
+			else {
+				fprintf(stderr, "Missing parameter for -f argument.\n\n");
+				printhelp(stderr);
+				return 1;
+			}
+		}
+		else if (strcmp(argv[i], "-x") == 0) {
+			hex_output = 1;
+		}
+		else if (strcmp(argv[i], "--textfile") == 0) {
+			i++;
+			if ((i < argc) && (argv[i][0] != '\0')) {
+				textfile_path = argv[i];
+			}
+			else {
+				fprintf(stderr, "Missing parameter for --textfile argument.\n\n");
+				printhelp(stderr);
+				return 1;
+			}
+		}
+		else if (strcmp(argv[i], "--stats-file") == 0) {
+			i++;
+			if ((i < argc) && (argv[i][0] != '\0')) {
+				stats_file = argv[i];
+			}
+			else {
+				fprintf(stderr, "Missing parameter for --stats-file argument.\n\n");
+				printhelp(stderr);
+				return 1;
+			}
+		}
+		else if (strcmp(argv[i], "--state") == 0) {
+			i++;
+			if ((i < argc) && (argv[i][0] != '\0')) {
+				state_file = argv[i];
+			}
+			else {
+				fprintf(stderr, "Missing parameter for --state argument.\n\n");
+				printhelp(stderr);
+				return 1;
+			}
+		}
+		else if (strcmp(argv[i], "--hook") == 0) {
+			i++;
+			if ((i < argc) && (argv[i][0] != '\0')) {
+				hook_command = argv[i];
+			}
+			else {
+				fprintf(stderr, "Missing parameter for --hook argument.\n\n");
+				printhelp(stderr);
+				return 1;
+			}
+		}
+		else if (strcmp(argv[i], "--profile") == 0) {
+			i++;
+			if ((i < argc) && (argv[i][0] != '\0')) {
+				profile_file = argv[i];
+			}
+			else {
+				fprintf(stderr, "Missing parameter for --profile argument.\n\n");
+				printhelp(stderr);
+				return 1;
+			}
+		}
+		else if (strcmp(argv[i], "--stats") == 0) {
+			print_stats = 1;
+		}
+		else if (strcmp(argv[i], "--since") == 0) {
+			i++;
+			if ((i < argc) && (argv[i][0] != '\0')) {
+				since_file = argv[i];
+			}
+			else {
+				fprintf(stderr, "Missing parameter for --since argument.\n\n");
+				printhelp(stderr);
+				return 1;
+			}
+		}
 		else if (strcmp(argv[i], "-b") == 0) {
 			i++;
 			if ((i < argc) && (argv[i][0] != '\0')) {
@@ -165,66 +536,12 @@ int main(int argc, char *argv[]) {
 					printhelp(stderr);
 					return 1;
 				}
-				switch (b) {
-					case 50:
-						baud = B50;
-						break;
-					case 75:
-						baud = B75;
-						break;
-					case 110:
-						baud = B110;
-						break;
-					case 134:
-						baud = B134;
-						break;
-					case 150:
-						baud = B150;
-						break;
-					case 200:
-						baud = B200;
-						break;
-					case 300:
-						baud = B300;
-						break;
-					case 600:
-						baud = B600;
-						break;
-					case 1200:
-						baud = B1200;
-						break;
-					case 1800:
-						baud = B1800;
-						break;
-					case 2400:
-						baud = B2400;
-						break;
-					case 4800:
-						baud = B4800;
-						break;
-					case 9600:
-						baud = B9600;
-						break;
-					case 19200:
-						baud = B19200;
-						break;
-					case 38400:
-						baud = B38400;
-						break;
-					case 57600:
-						baud = B57600;
-						break;
-					case 115200:
-						baud = B115200;
-						break;
-					case 230400:
-						baud = B230400;
-						break;
-					default:
-						fprintf(stderr, "Invalid parameter '%s' for -b argument.\n\n", argv[i]);
-						printhelp(stderr);
-						return 1;
+				if ((baud = serialspeed(b)) == B0) {
+					fprintf(stderr, "Invalid parameter '%s' for -b argument.\n\n", argv[i]);
+					printhelp(stderr);
+					return 1;
 				}
+				baud_given = 1;
 			}
 			else {
 				fprintf(stderr, "Missing parameter for -b argument.\n\n");
@@ -232,55 +549,226 @@ int main(int argc, char *argv[]) {
 				return 1;
 			}
 		}
-		else {
-			if (c != NULL) {
-				fprintf(stderr, "Unsupported or unexpected command '%s' of interface '%s'.\n\n", argv[i], iface->name);
+		else if (strcmp(argv[i], "-w") == 0) {
+			i++;
+			if ((i < argc) && (argv[i][0] != '\0')) {
+				char *end;
+				lock_timeout = strtol(argv[i], &end, 10);
+				if ((*end != '\0') || (lock_timeout < 0)) {
+					fprintf(stderr, "Invalid parameter '%s' for -w argument.\n\n", argv[i]);
+					printhelp(stderr);
+					return 1;
+				}
+			}
+			else {
+				fprintf(stderr, "Missing parameter for -w argument.\n\n");
 				printhelp(stderr);
 				return 1;
 			}
-
-			command *j;
-			for (j = iface->commands; j->name != NULL; j++) {
-				if (strcmp(j->name, argv[i]) == 0) {
-					c = j->function;
-					break;
+		}
+		else if (strcmp(argv[i], "-q") == 0) {
+			i++;
+			if ((i < argc) && (argv[i][0] != '\0')) {
+				char *end;
+				pipeline_depth = strtol(argv[i], &end, 10);
+				if ((*end != '\0') || (pipeline_depth <= 0) || (pipeline_depth > PIPELINE_MAX)) {
+					fprintf(stderr, "Invalid parameter '%s' for -q argument.\n\n", argv[i]);
+					printhelp(stderr);
+					return 1;
 				}
 			}
-
-			if (c == NULL) {
-				if (strcmp(argv[i], "help") == 0) {
-					c = help;
-				}
-				else if (strcmp(argv[i], "version") == 0) {
-					c = version;
+			else {
+				fprintf(stderr, "Missing parameter for -q argument.\n\n");
+				printhelp(stderr);
+				return 1;
+			}
+		}
+		else if (strcmp(argv[i], "-u") == 0) {
+			i++;
+			if ((i < argc) && (argv[i][0] != '\0')) {
+				socket_path = argv[i];
+			}
+			else {
+				fprintf(stderr, "Missing parameter for -u argument.\n\n");
+				printhelp(stderr);
+				return 1;
+			}
+		}
+		else if (strcmp(argv[i], "-m") == 0) {
+			i++;
+			if ((i < argc) && (argv[i][0] != '\0')) {
+				char *end;
+				cache_maxage = strtol(argv[i], &end, 10);
+				if ((*end != '\0') || (cache_maxage < 0)) {
+					fprintf(stderr, "Invalid parameter '%s' for -m argument.\n\n", argv[i]);
+					printhelp(stderr);
+					return 1;
 				}
-				else {
-					fprintf(stderr, "Unsupported command '%s' of interface '%s'.\n\n", argv[i], iface->name);
+			}
+			else {
+				fprintf(stderr, "Missing parameter for -m argument.\n\n");
+				printhelp(stderr);
+				return 1;
+			}
+		}
+		else if (strcmp(argv[i], "-t") == 0) {
+			i++;
+			if ((i < argc) && (argv[i][0] != '\0')) {
+				char *end;
+				reply_timeout = strtol(argv[i], &end, 10);
+				if ((*end != '\0') || (reply_timeout <= 0)) {
+					fprintf(stderr, "Invalid parameter '%s' for -t argument.\n\n", argv[i]);
 					printhelp(stderr);
 					return 1;
 				}
 			}
+			else {
+				fprintf(stderr, "Missing parameter for -t argument.\n\n");
+				printhelp(stderr);
+				return 1;
+			}
+		}
+		else {
+			command *c = findcommand(iface->commands, argv[i]);
+			if (c == NULL) c = findcommand(builtin_commands, argv[i]);
+			else needsport = 1;
+
+			if ((c != NULL) && (c->function == run_daemon)) needsport = 1;
+
+			if (c == NULL) {
+				fprintf(stderr, "Unsupported command '%s' of interface '%s'.\n\n", argv[i], iface->name);
+				printhelp(stderr);
+				return 1;
+			}
+
+			batch[count++] = c;
+
+			if (c->arguments != 0) {
+				arguments = argv + i + 1;
+				arguments_count = argc - i - 1;
+
+				// Without arguments such command only lists what it accepts
+				if ((arguments_count == 0) && (count == 1)) needsport = 0;
+				break;
+			}
 		}
 	}
 
-	if (c == NULL) {
+	if (count == 0) {
 		fprintf(stderr, "Missing command argument of interface '%s'.\n\n", iface->name);
 		printhelp(stderr);
 		return 1;
 	}
 
-	int fd;
-	if ((c != help) && (c != version) && ((fd = openserialport()) == -1)) {
-		fprintf(stderr, "Could not open serial port device file '%s': %s.\n", device, strerror(errno));
-		return 2;
+	for (i = 0; i < count; i++) {
+		if ((batch[i]->function == run_daemon) && (count > 1)) {
+			fprintf(stderr, "Command 'daemon' cannot be combined with other commands.\n\n");
+			printhelp(stderr);
+			return 1;
+		}
+
+		// A dump would be replaced by another one
+		if ((batch[i]->function != pli_dumpram) && (batch[i]->function != pli_dumpeeprom)) continue;
+		int j;
+		for (j = 0; j < i; j++) {
+			if ((batch[j]->function != pli_dumpram) && (batch[j]->function != pli_dumpeeprom)) continue;
+			if ((dump_file == NULL) && (batch[j]->function != batch[i]->function)) continue;
+
+			fprintf(stderr, "Commands '%s' and '%s' cannot dump into the same file.\n\n", batch[j]->name, batch[i]->name);
+			printhelp(stderr);
+			return 1;
+		}
 	}
 
-	int ret = c(fd);
+	// Values in the snapshot are read without accessing the serial port
+	if (use_snapshot != 0) {
+		for (i = 0; i < count; i++) {
+			if (findcommand(builtin_commands, batch[i]->name) == batch[i]) {
+				if (batch[i]->function != run_daemon) continue;
+			}
+			else {
+				int j;
+				for (j = 0; (snapshot_commands[j] != NULL) && (strcmp(snapshot_commands[j], batch[i]->name) != 0); j++);
+				if (snapshot_commands[j] != NULL) continue;
+			}
 
-	if ((c != help) && (c != version) && (close(fd) == -1)) {
-		fprintf(stderr, "Could not close serial port device file '%s': %s.\n", device, strerror(errno));
+			fprintf(stderr, "Command '%s' is not available from shared memory snapshot.\n\n", batch[i]->name);
+			printhelp(stderr);
+			return 1;
+		}
+		needsport = 0;
+	}
+
+	// Values are read from all devices at once
+	if ((devices != NULL) && (needsport != 0) && ((use_snapshot != 0) || (socket_path != NULL))) {
+		fprintf(stderr, "Argument -D cannot be combined with -s or -u arguments.\n\n");
+		printhelp(stderr);
+		return 1;
+	}
+
+	if ((devices != NULL) && (profile_file != NULL)) {
+		fprintf(stderr, "Argument -D cannot be combined with --profile argument.\n\n");
+		printhelp(stderr);
+		return 1;
+	}
+
+	// Output is written into a temporary file which replaces the text file only
+	// at the end
+	FILE *textfile = NULL;
+	char temporary[PATH_MAX];
+	if (textfile_path != NULL) {
+		if (batch[0]->function == run_daemon) {
+			fprintf(stderr, "Command 'daemon' cannot be combined with --textfile argument.\n\n");
+			printhelp(stderr);
+			return 1;
+		}
+		if ((textfile = open_replacement(textfile_path, temporary, sizeof(temporary), "text file")) == NULL) return 2;
+		out = textfile;
+	}
+
+	// Baud found by the probe command is used unless one is given
+	char path[PATH_MAX];
+	link_profile profile;
+	if ((baud_given == 0) && (profile_path(device, path, sizeof(path)) == 0) && (load_profile(path, &profile) == 0)) {
+		if ((baud = serialspeed(profile.baud)) == B0) baud = DEFAULT_BAUD;
+	}
+
+	// Options apply to the session of all commands
+	solar_ctx *session;
+	if ((session = new_session()) == NULL) {
+		fprintf(stderr, "Could not allocate memory: %s.\n", strerror(errno));
 		return 2;
 	}
+	session->reply_timeout = reply_timeout;
+	session->pipeline_depth = pipeline_depth;
+	// Commands of a batch share values for the whole session unless -m is given
+	session->cache_maxage = cache_maxage;
+	session->report = report_failure;
+
+	int ret;
+	if ((devices != NULL) && (needsport != 0)) {
+		ret = run_multi(devices, batch, count, &session->stats);
+	}
+	// With a daemon running commands are executed by it
+	else if ((socket_path != NULL) && (needsport != 0) && (batch[0]->function != run_daemon)) {
+		ret = run_client(batch, count);
+		needsport = 0;
+	}
+	else {
+		ret = run_batch(session, batch, count, needsport);
+	}
+
+	if ((needsport != 0) && (print_stats != 0)) printstats(&session->stats);
+	if ((needsport != 0) && (stats_file != NULL)) appendstats(stats_file, ret, &session->stats);
+	free(session);
+
+	// Values in machine-readable formats are output together
+	flush_metrics();
+
+	if (textfile != NULL) {
+		out = stdout;
+		if ((close_replacement(textfile, textfile_path, temporary, ret == 0, "text file") == -1) && (ret == 0)) ret = 2;
+	}
 
 	return ret;
 }
@@ -3,30 +3,70 @@
 
 #include <stdio.h>
 
+#include "solar.h"
+
 #define VERSION "0.1"
 #define DEFAULT_DEVICE_FILE "/dev/tts/1"
 #define DEFAULT_BAUD B9600
 #define DEFAULT_BAUD_NAME 9600
 #define DEFAULT_INTERFACE "pli"
-#define IO_WAIT 10
+#define DEFAULT_LOCK_TIMEOUT 10000
+#define DEFAULT_REPLY_TIMEOUT 2000
+#define DEFAULT_INTERVAL 10
+#define DEFAULT_PIPELINE_DEPTH 1
+#define FORMAT_TEXT 0
+#define FORMAT_CSV 1
+#define FORMAT_JSON 2
+#define FORMAT_PROM 3
+#define STATS_LINE 1024
+#define COMMAND_ENDLESS 1 // Runs until it is terminated
+#define COMMAND_CHANGES 2 // Changes state of the regulator or of the link to it
+#define COMMAND_FILES 4 // Writes files
 
 typedef struct {
 	char *name;
 	char *description;
-	int (*function)(int fd);
+	int (*function)(solar_ctx *ctx);
+	int arguments; // Command takes all following arguments, so it has to be the last one
+	int flags; // COMMAND_*, commands without any can be executed by the daemon
 } command;
 
 typedef struct {
 	char *name;
 	command *commands;
+	int (*finish)(solar_ctx *ctx); // Restores device state at the end of a session, can be NULL
 } interface;
 
+extern char *device;
+extern FILE *out;
 extern int plain_output;
+extern int reply_timeout;
+extern int lock_timeout;
+extern int pipeline_depth;
+extern int cache_maxage;
+extern char *socket_path;
+extern int use_snapshot;
+extern int interval;
+extern char *log_file;
+extern int log_records;
+extern unsigned char registers[];
+extern int registers_count;
+extern int log_layout_given;
+extern int output_format;
+extern char *dump_file;
+extern int hex_output;
+extern char *since_file;
+extern char *profile_file;
+extern char *state_file;
+extern char *hook_command;
+extern char **arguments;
+extern int arguments_count;
+extern interface *iface;
+extern command builtin_commands[];
 
-int help(int fd);
-int version(int fd);
+int help(solar_ctx *ctx);
+int version(solar_ctx *ctx);
 void printhelp(FILE *output);
-void lockwait(int signal);
-int openserialport();
+command *findcommand(command *commands, char *name);
 
 #endif /* MAIN_H_ */
@@ -0,0 +1,98 @@
+#include <string.h>
+#include <math.h>
+
+#include "metric.h"
+#include "protocol.h"
+
+metric *find_metric(metric *metrics, char *name) {
+	metric *m;
+	for (m = metrics; m->name != NULL; m++) {
+		if (strcmp(m->name, name) == 0) return m;
+	}
+	return NULL;
+}
+
+// Stores locations of registers in memory space of op which metrics without a
+// read function depend on, each only once and in order, returns their number
+int plan_registers(metric *metrics[], int count, unsigned char op, unsigned char locations[]) {
+	unsigned char needed[256];
+	memset(needed, 0, sizeof(needed));
+
+	int i;
+	int j;
+	for (i = 0; i < count; i++) {
+		if ((metrics[i]->read != NULL) || (metrics[i]->op != op)) continue;
+		for (j = 0; j < metrics[i]->count; j++) {
+			needed[metrics[i]->locations[j]] = 1;
+		}
+	}
+
+	int n = 0;
+	for (j = 0; j < 256; j++) {
+		if (needed[j] != 0) locations[n++] = j;
+	}
+	return n;
+}
+
+// Decodes value of a metric from values of registers of its memory space,
+// indexed by location, NAN if any of them could not be read (is -1)
+double decode_metric(metric *m, int registers[]) {
+	int raw[METRIC_LOCATIONS];
+	int j;
+	for (j = 0; j < m->count; j++) {
+		if ((raw[j] = registers[m->locations[j]]) == -1) return NAN;
+	}
+
+	return ((m->decode != NULL) ? m->decode(raw) : raw[0]) * m->scale;
+}
+
+// Reads values of metrics, planning the smallest set of register reads: every
+// register any of them depends on is read only once, in one pipelined exchange
+// for each memory space
+// Values of metrics which could not be read are NAN and -1 is returned
+int read_metrics(solar_ctx *ctx, metric *metrics[], int count, double values[]) {
+	unsigned char ops[] = {0x14, 0x48};
+	int registers[sizeof(ops)][256];
+	int ret = 0;
+	int i;
+	int j;
+	int s;
+
+	for (i = 0; i < count; i++) {
+		values[i] = NAN;
+	}
+
+	for (s = 0; s < sizeof(ops); s++) {
+		unsigned char locations[256];
+		int n = plan_registers(metrics, count, ops[s], locations);
+		if (n == 0) continue;
+
+		int fetched[n];
+		if (read_registers(ctx, ops[s], locations, fetched, n) == -1) return -1;
+
+		for (j = 0; j < n; j++) {
+			// Reads again a register rejected with an error code to report it
+			if (fetched[j] == -1) fetched[j] = (ops[s] == 0x14) ? read_processor(ctx, locations[j]) : read_eprom(ctx, locations[j]);
+			registers[s][locations[j]] = fetched[j];
+		}
+	}
+
+	for (i = 0; i < count; i++) {
+		metric *m = metrics[i];
+		if (m->read != NULL) continue;
+
+		values[i] = decode_metric(m, registers[(m->op == ops[0]) ? 0 : 1]);
+		if (isnan(values[i])) ret = -1;
+	}
+
+	// Metrics with their own read function are read last as they can change
+	// regulator state
+	for (i = 0; i < count; i++) {
+		if ((metrics[i]->read != NULL) && (metrics[i]->read(ctx, &values[i]) == -1)) {
+			values[i] = NAN;
+			ret = -1;
+		}
+	}
+
+	return ret;
+}
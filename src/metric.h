@@ -0,0 +1,35 @@
+#ifndef METRIC_H_
+#define METRIC_H_
+
+#include "solar.h"
+
+#define METRIC_LOCATIONS 4
+#define METRIC_NUMBER 0
+#define METRIC_ENUM 1
+#define METRIC_TIME 2
+
+// A value decoded from registers, which are all in the same memory space
+// Value is decode(values of locations) * scale, or value of the first location
+// * scale if there is no decode function; metrics which cannot be just decoded
+// from registers have a read function instead
+typedef struct {
+	char *name;
+	char *label;
+	char *unit;
+	int type;
+	int precision;
+	unsigned char op; // Read command of the memory space (0x14 processor, 0x48 EEPROM)
+	int count;
+	unsigned char locations[METRIC_LOCATIONS];
+	double (*decode)(int values[]);
+	double scale;
+	char **names; // Names of values of METRIC_ENUM metrics
+	int (*read)(solar_ctx *ctx, double *value);
+} metric;
+
+metric *find_metric(metric *metrics, char *name);
+int plan_registers(metric *metrics[], int count, unsigned char op, unsigned char locations[]);
+double decode_metric(metric *m, int registers[]);
+int read_metrics(solar_ctx *ctx, metric *metrics[], int count, double values[]);
+
+#endif /* METRIC_H_ */
@@ -0,0 +1,542 @@
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <errno.h>
+#include <unistd.h>
+#include <math.h>
+#include <limits.h>
+#include <sys/epoll.h>
+#include <sys/uio.h>
+
+#include "multi.h"
+#include "main.h"
+#include "pli.h"
+#include "protocol.h"
+#include "output.h"
+#include "metric.h"
+#include "serial.h"
+#include "profile.h"
+
+// Polls many regulators from one process: commands of all devices are driven
+// concurrently from one epoll loop, so the whole poll takes as long as the
+// slowest device and not as long as all of them together
+// Only reading of metrics is supported as other commands need the whole
+// session for themselves
+
+static unsigned char ops[] = {OP_READ_PROCESSOR, OP_READ_EEPROM};
+
+// Parses a list of '<device>[:<baud>]' separated by commas
+static int parse_devices(char *list, device_context *devices) {
+	int count = 0;
+	char *saved;
+	char *item;
+	for (item = strtok_r(list, ",", &saved); item != NULL; item = strtok_r(NULL, ",", &saved)) {
+		if (count == MULTI_DEVICES) {
+			fprintf(stderr, "Too many devices, at most %d are supported.\n", MULTI_DEVICES);
+			return -1;
+		}
+
+		device_context *d = &devices[count];
+		memset(d, 0, sizeof(device_context));
+		d->device = item;
+		d->baud = DEFAULT_BAUD;
+		d->fd = -1;
+		d->depth = pipeline_depth;
+
+		char path[PATH_MAX];
+		link_profile profile;
+		char *separator = strrchr(item, ':');
+		if (separator == NULL) {
+			// Baud found by the probe command is used unless one is given
+			if ((profile_path(item, path, sizeof(path)) == 0) && (load_profile(path, &profile) == 0) && (serialspeed(profile.baud) != B0)) {
+				d->baud = serialspeed(profile.baud);
+			}
+		}
+		else {
+			*separator = '\0';
+			char *end;
+			int b = strtol(separator + 1, &end, 10);
+			if ((*end != '\0') || ((d->baud = serialspeed(b)) == B0)) {
+				fprintf(stderr, "Invalid baud rate '%s' of device '%s'.\n", separator + 1, item);
+				return -1;
+			}
+		}
+		if (item[0] == '\0') {
+			fprintf(stderr, "Invalid device list.\n");
+			return -1;
+		}
+
+		count++;
+	}
+	return count;
+}
+
+// Finds metrics whose values a command outputs: 'get' with its arguments and
+// commands named after a metric, with or without 'get' prefix
+static int command_metrics(command *c, metric *metrics[], int size) {
+	int count = 0;
+	if ((size == 0) || ((strcmp(c->name, "get") == 0) && (arguments_count > size))) {
+		fprintf(stderr, "Too many metrics, at most %d are supported.\n", MULTI_METRICS);
+		return -1;
+	}
+
+	if (strcmp(c->name, "get") == 0) {
+		int i;
+		for (i = 0; i < arguments_count; i++) {
+			if ((metrics[count++] = find_metric(pli_metrics, arguments[i])) == NULL) {
+				fprintf(stderr, "Unsupported metric '%s'.\n", arguments[i]);
+				return -1;
+			}
+		}
+		return count;
+	}
+
+	metric *m = find_metric(pli_metrics, c->name);
+	if ((m == NULL) && (strncmp(c->name, "get", 3) == 0)) m = find_metric(pli_metrics, c->name + 3);
+	if (m == NULL) {
+		fprintf(stderr, "Command '%s' is not supported with multiple devices.\n", c->name);
+		return -1;
+	}
+
+	metrics[0] = m;
+	return 1;
+}
+
+static void fail_device(device_context *d, char *reason) {
+	if (d->failed != 0) return;
+	fprintf(stderr, "%s (device '%s').\n", reason, d->device);
+	d->failed = 1;
+}
+
+// Counts bytes of a write of length bytes to the serial port, which does not
+// block, so it can be short; returns -1 if it failed
+static int written(device_context *d, ssize_t count, int length) {
+	if (count == -1) {
+		if ((errno != EAGAIN) && (errno != EINTR)) {
+			fail_device(d, "Could not send command");
+			return -1;
+		}
+		count = 0;
+	}
+	d->stats->written += count;
+	if (count < length) d->blocked = 1;
+	return count;
+}
+
+// Sends a loopback command to verify the link after a recovery
+static void verify(device_context *d) {
+	encode_request(d->loopback, OP_LOOPBACK, 0x00, 0x00);
+	d->verifying = VERIFY_SENT;
+	d->received = 0;
+	d->deadline = monotonic_ms() + reply_timeout;
+
+	int count;
+	if ((count = written(d, write(d->fd, d->loopback, FRAME_SIZE), FRAME_SIZE)) == -1) return;
+	if (count < FRAME_SIZE) {
+		d->tail = d->loopback + count;
+		d->tail_length = FRAME_SIZE - count;
+	}
+}
+
+// Sends commands while there is room in the pipeline, all in one write; what
+// the serial port does not take is written when it becomes writable
+static void pump(device_context *d) {
+	if (d->failed != 0) return;
+	d->blocked = 0;
+
+	// PLI would misread another frame after a part of one
+	if (d->tail_length > 0) {
+		int count;
+		if ((count = written(d, write(d->fd, d->tail, d->tail_length), d->tail_length)) == -1) return;
+		d->tail += count;
+		d->tail_length -= count;
+		if (d->tail_length > 0) return;
+	}
+
+	if (d->draining != 0) return;
+	if (d->verifying == VERIFY_PENDING) verify(d);
+	if (d->verifying != VERIFY_NONE) return;
+
+	struct iovec iov[PIPELINE_MAX];
+	int n = 0;
+	while ((d->sent + n < d->count) && (d->sent + n - d->done < d->depth)) {
+		iov[n].iov_base = d->transactions[d->sent + n].request;
+		iov[n].iov_len = FRAME_SIZE;
+		n++;
+	}
+	if (n == 0) return;
+
+	int count;
+	if ((count = written(d, writev(d->fd, iov, n), n * FRAME_SIZE)) == -1) return;
+
+	// A partly written frame is sent, with its rest kept as the tail
+	long long now = monotonic_ms();
+	for (; count > 0; count -= FRAME_SIZE) {
+		transaction *t = &d->transactions[d->sent];
+		t->sent = now;
+		if (d->sent == d->done) d->deadline = now + reply_timeout;
+		d->sent++;
+
+		if (count < FRAME_SIZE) {
+			d->tail = t->request + count;
+			d->tail_length = FRAME_SIZE - count;
+		}
+	}
+}
+
+// Watches the serial port for writability only while writes are short
+static void watch_device(int epfd, device_context *d) {
+	struct epoll_event event;
+	event.events = EPOLLIN | ((d->blocked != 0) ? EPOLLOUT : 0);
+	event.data.ptr = d;
+	if (event.events == d->events) return;
+
+	if (epoll_ctl(epfd, EPOLL_CTL_MOD, d->fd, &event) == -1) {
+		fail_device(d, "Could not watch serial port");
+		return;
+	}
+	d->events = event.events;
+}
+
+// Falls back to one command at a time, dropping any responses still in flight
+static void fallback(device_context *d) {
+	d->stats->fallbacks++;
+	d->stats->retries += d->sent - d->done;
+	d->depth = 1;
+	d->draining = monotonic_ms() + DRAIN_WAIT;
+	d->received = 0;
+	d->sent = d->done;
+}
+
+// Gets back in sync after lost or corrupted data by dropping input for
+// longer every time and verifying the link with a loopback command, before
+// the commands in flight are sent again, one at a time
+static void recover(device_context *d, char *reason) {
+	if (d->recoveries == RECOVERY_RETRY) {
+		fail_device(d, reason);
+		return;
+	}
+
+	long long backoff = (long long)RECOVERY_BACKOFF << d->recoveries;
+	d->recoveries++;
+	d->stats->recoveries++;
+
+	fallback(d);
+	d->draining += (backoff < RECOVERY_BACKOFF_MAX) ? backoff : RECOVERY_BACKOFF_MAX;
+	d->verifying = VERIFY_PENDING;
+}
+
+// Matches received bytes to the reply to a loopback command, returns the
+// number of bytes used
+static int receive_loopback(device_context *d, unsigned char *bytes, int count) {
+	unsigned char frame[FRAME_SIZE];
+	pli_reply reply;
+	encode_request(frame, OP_LOOPBACK, 0x00, 0x00);
+
+	int i;
+	for (i = 0; i < count; i++) {
+		d->frame[d->received++] = bytes[i];
+
+		if (d->received == 1) {
+			if ((d->expected = reply_length(reply_kind(frame, bytes[i]))) == 0) {
+				recover(d, "Invalid response");
+				return count;
+			}
+		}
+		if (d->received < d->expected) continue;
+		d->received = 0;
+
+		if (decode_reply(frame, d->frame, d->expected, &reply) == -1) {
+			recover(d, "Invalid response");
+			return count;
+		}
+		if (reply.kind == REPLY_ECHO) {
+			d->stats->echoes++;
+			continue;
+		}
+		if (reply.kind != REPLY_ACK) {
+			count_error(d->stats, reply.code);
+			recover(d, "Invalid response");
+			return count;
+		}
+
+		d->verifying = VERIFY_NONE;
+		return i + 1;
+	}
+	return count;
+}
+
+// Matches received bytes to commands in flight, skipping echoed commands
+static void receive_bytes(device_context *d, unsigned char *bytes, int count) {
+	int i = 0;
+	if ((d->verifying == VERIFY_SENT) && (d->draining == 0)) i = receive_loopback(d, bytes, count);
+	if (d->verifying != VERIFY_NONE) return;
+
+	for (; (i < count) && (d->failed == 0) && (d->draining == 0) && (d->done < d->sent); i++) {
+		transaction *t = &d->transactions[d->done];
+		d->frame[d->received++] = bytes[i];
+
+		// The first byte of a reply determines its length
+		if (d->received == 1) {
+			if ((d->expected = reply_length(reply_kind(t->request, bytes[i]))) == 0) {
+				recover(d, "Invalid response");
+				return;
+			}
+		}
+		if (d->received < d->expected) continue;
+		d->received = 0;
+
+		if (decode_reply(t->request, d->frame, d->expected, &t->reply) == -1) {
+			recover(d, "Invalid response");
+			return;
+		}
+		if (t->reply.kind == REPLY_ECHO) {
+			d->stats->echoes++;
+			continue;
+		}
+
+		count_latency(d->stats, monotonic_ms() - t->sent);
+
+		int s = (t->request[0] == ops[0]) ? 0 : 1;
+		if (t->reply.kind == REPLY_DATA) {
+			d->registers[s][t->request[1]] = t->reply.value;
+		}
+		else if (d->depth > 1) {
+			count_error(d->stats, t->reply.code);
+			fallback(d);
+			return;
+		}
+		else if ((t->reply.code != 0x83) && (t->reply.code != 0x84) && (d->recoveries < RECOVERY_RETRY)) {
+			// PLI did not get a response from the regulator or the command was corrupted
+			count_error(d->stats, t->reply.code);
+			recover(d, "Invalid response");
+			return;
+		}
+		else {
+			count_error(d->stats, t->reply.code);
+			d->registers[s][t->request[1]] = -1;
+		}
+
+		d->done++;
+		d->recoveries = 0;
+		d->deadline = monotonic_ms() + reply_timeout;
+	}
+}
+
+static int finished(device_context *d) {
+	return (d->failed != 0) || (d->done == d->count);
+}
+
+// Opens and locks the serial port without waiting, a port locked by another
+// process is tried again from the poll loop until lock_timeout milliseconds
+// after start, which all devices share
+// The wait is counted from start instead of what openserialport counts for
+// every attempt
+// Returns -1 if the device failed
+static int open_device(device_context *d, long long start) {
+	long long waited = d->stats->lock_wait;
+	if ((d->fd = openserialport(d->device, d->baud, 0, d->stats)) != -1) {
+		d->stats->lock_wait = waited + d->stats->locked_at - start;
+		return 0;
+	}
+	d->stats->lock_wait = waited;
+
+	long long now = monotonic_ms();
+	if ((errno == ETIMEDOUT) && (now < start + lock_timeout)) {
+		d->lock_retry = now + LOCK_RETRY_WAIT;
+		return 0;
+	}
+
+	if (errno == ETIMEDOUT) {
+		d->stats->lock_wait += now - start;
+		fprintf(stderr, "Timeout while waiting for serial port device file '%s'.\n", d->device);
+	}
+	else fprintf(stderr, "Could not open serial port device file '%s': %s.\n", d->device, strerror(errno));
+	d->failed = 2;
+	return -1;
+}
+
+// Starts sending commands to a device whose serial port is locked
+static void start_device(int epfd, device_context *d) {
+	struct epoll_event event;
+	event.events = EPOLLIN;
+	event.data.ptr = d;
+	if (epoll_ctl(epfd, EPOLL_CTL_ADD, d->fd, &event) == -1) {
+		fail_device(d, "Could not watch serial port");
+		return;
+	}
+	d->events = event.events;
+	pump(d);
+	watch_device(epfd, d);
+}
+
+static void poll_devices(device_context *devices, int count, long long start) {
+	int epfd;
+	if ((epfd = epoll_create1(0)) == -1) {
+		fprintf(stderr, "Could not create epoll instance: %s.\n", strerror(errno));
+		int i;
+		for (i = 0; i < count; i++) devices[i].failed = 1;
+		return;
+	}
+
+	int active = 0;
+	int i;
+	for (i = 0; i < count; i++) {
+		device_context *d = &devices[i];
+		if (finished(d)) continue;
+
+		if (d->fd != -1) start_device(epfd, d);
+		if (!finished(d)) active++;
+	}
+
+	while (active > 0) {
+		long long now = monotonic_ms();
+		long long next = -1;
+		for (i = 0; i < count; i++) {
+			device_context *d = &devices[i];
+			if (finished(d)) continue;
+			long long at = (d->fd == -1) ? d->lock_retry : (d->draining != 0) ? d->draining : d->deadline;
+			if ((next == -1) || (at < next)) next = at;
+		}
+
+		struct epoll_event events[MULTI_DEVICES];
+		int ready = epoll_wait(epfd, events, MULTI_DEVICES, (next > now) ? (int)(next - now) : 0);
+		if ((ready == -1) && (errno != EINTR)) {
+			fprintf(stderr, "Could not wait for serial ports: %s.\n", strerror(errno));
+			for (i = 0; i < count; i++) devices[i].failed = 1;
+			break;
+		}
+
+		for (i = 0; i < ready; i++) {
+			device_context *d = events[i].data.ptr;
+			if ((events[i].events & (EPOLLIN | EPOLLERR | EPOLLHUP)) == 0) continue;
+
+			unsigned char buffer[FRAME_SIZE * PIPELINE_MAX];
+			int r = read(d->fd, buffer, sizeof(buffer));
+			if (r > 0) {
+				d->stats->read += r;
+				receive_bytes(d, buffer, r);
+			}
+			else if (r == 0) {
+				fail_device(d, "Could not read response: device disconnected");
+			}
+			else if ((errno != EAGAIN) && (errno != EINTR)) {
+				fail_device(d, "Could not read response");
+			}
+		}
+
+		now = monotonic_ms();
+		active = 0;
+		for (i = 0; i < count; i++) {
+			device_context *d = &devices[i];
+			if (finished(d)) continue;
+
+			if (d->fd == -1) {
+				if ((now >= d->lock_retry) && (open_device(d, start) != -1) && (d->fd != -1)) start_device(epfd, d);
+				if (!finished(d)) active++;
+				continue;
+			}
+
+			if (d->draining != 0) {
+				if (now >= d->draining) d->draining = 0;
+			}
+			else if (now >= d->deadline) {
+				if (d->depth > 1) fallback(d);
+				else recover(d, "Timeout while waiting for response");
+				d->stats->timeouts++;
+			}
+
+			pump(d);
+			if (!finished(d)) {
+				watch_device(epfd, d);
+				active++;
+			}
+			else epoll_ctl(epfd, EPOLL_CTL_DEL, d->fd, NULL);
+		}
+	}
+
+	close(epfd);
+}
+
+// Reads metrics of given commands from every device in a list of
+// '<device>[:<baud>]', output lines are prefixed with the device
+int run_multi(char *list, command *batch[], int count, serial_counters *stats) {
+	device_context devices[MULTI_DEVICES];
+	int devices_count;
+	if ((devices_count = parse_devices(list, devices)) <= 0) return 1;
+
+	metric *metrics[MULTI_METRICS];
+	int metrics_count = 0;
+	int i;
+	int j;
+	for (i = 0; i < count; i++) {
+		int n;
+		if ((n = command_metrics(batch[i], metrics + metrics_count, MULTI_METRICS - metrics_count)) == -1) return 1;
+		metrics_count += n;
+	}
+	for (i = 0; i < metrics_count; i++) {
+		if (metrics[i]->read != NULL) {
+			fprintf(stderr, "Metric '%s' is not supported with multiple devices.\n", metrics[i]->name);
+			return 1;
+		}
+	}
+
+	// The same registers are read from every device
+	transaction transactions[sizeof(ops) * 256];
+	int transactions_count = 0;
+	int s;
+	for (s = 0; s < sizeof(ops); s++) {
+		unsigned char locations[256];
+		int n = plan_registers(metrics, metrics_count, ops[s], locations);
+		for (j = 0; j < n; j++) {
+			encode_request(transactions[transactions_count++].request, ops[s], locations[j], 0x00);
+		}
+	}
+
+	// Serial ports are locked at once, waiting for all of them at most
+	// lock_timeout milliseconds
+	long long start = monotonic_ms();
+	int ret = 0;
+	for (i = 0; i < devices_count; i++) {
+		device_context *d = &devices[i];
+		d->count = transactions_count;
+		d->stats = stats;
+		memset(d->registers, 0xFF, sizeof(d->registers));
+
+		// Every device has its own copy for times when commands were sent
+		if ((d->transactions = malloc((transactions_count + 1) * sizeof(transaction))) == NULL) {
+			fprintf(stderr, "Could not allocate memory: %s.\n", strerror(errno));
+			d->failed = 1;
+			ret = 2;
+			continue;
+		}
+		memcpy(d->transactions, transactions, transactions_count * sizeof(transaction));
+
+		open_device(d, start);
+	}
+
+	poll_devices(devices, devices_count, start);
+	stats->lock_held = monotonic_ms() - stats->locked_at;
+
+	for (i = 0; i < devices_count; i++) {
+		device_context *d = &devices[i];
+		if (d->fd != -1) close(d->fd);
+		free(d->transactions);
+		if (d->failed != 0) {
+			if (ret == 0) ret = (d->failed == 2) ? 2 : 3;
+			continue;
+		}
+
+		for (j = 0; j < metrics_count; j++) {
+			double value = decode_metric(metrics[j], d->registers[(metrics[j]->op == ops[0]) ? 0 : 1]);
+			if (isnan(value)) {
+				fprintf(stderr, "Could not read '%s' (device '%s').\n", metrics[j]->name, d->device);
+				if (ret == 0) ret = 3;
+				continue;
+			}
+			print_metric(d->device, metrics[j], value);
+		}
+	}
+
+	return ret;
+}
@@ -0,0 +1,48 @@
+#ifndef MULTI_H_
+#define MULTI_H_
+
+#include <termios.h>
+
+#include "main.h"
+#include "protocol.h"
+
+#define MULTI_DEVICES 16
+#define MULTI_METRICS 32
+
+// States of verifying the link with a loopback command after a recovery
+#define VERIFY_NONE 0
+#define VERIFY_PENDING 1 // Sent once input is drained
+#define VERIFY_SENT 2
+
+// State of one regulator polled in multi-device mode, which is used in place
+// of global device and baud
+typedef struct {
+	char *device;
+	speed_t baud;
+	int fd; // -1 while waiting for the lock of the serial port
+	long long lock_retry; // When to try to lock the serial port again
+	int depth; // Pipeline depth, falls back to 1 as in transact
+	transaction *transactions;
+	int count;
+	int sent;
+	int done;
+	unsigned char *tail; // Rest of a partly written frame, written before anything else
+	int tail_length;
+	int blocked; // Last write was short, so the serial port is watched for writability
+	int events; // Watched with epoll
+	unsigned char loopback[FRAME_SIZE];
+	unsigned char frame[FRAME_SIZE];
+	int received;
+	int expected;
+	long long deadline; // For the response to the oldest command in flight
+	long long draining; // Responses are dropped until then after a pipelining failure, 0 if not
+	int failed; // 2 if the serial port could not be opened
+	int recoveries; // Attempts to get back in sync for the oldest command, at most RECOVERY_RETRY
+	int verifying; // VERIFY_*, commands are not sent until the link is verified
+	int registers[2][256]; // Values of processor and EEPROM registers, -1 if they could not be read
+	serial_counters *stats; // Shared by all devices
+} device_context;
+
+int run_multi(char *devices, command *batch[], int count, serial_counters *stats);
+
+#endif /* MULTI_H_ */
@@ -0,0 +1,182 @@
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <errno.h>
+#include <time.h>
+
+#include "output.h"
+#include "main.h"
+#include "metric.h"
+#include "serial.h"
+
+// In machine-readable formats values of all commands in a batch are collected
+// and output together at its end, as JSON and Prometheus formats need to see
+// all of them
+
+static output_record *records = NULL;
+static int records_count = 0;
+static int records_size = 0;
+
+// Names of output formats, by FORMAT_* value
+char *format_names[] = {"text", "csv", "json", "prom", NULL};
+
+int parse_format(char *name) {
+	int i;
+	for (i = 0; format_names[i] != NULL; i++) {
+		if (strcmp(format_names[i], name) == 0) return i;
+	}
+	return -1;
+}
+
+// Outputs a value, prefixed with its device if it is not NULL; in
+// machine-readable formats it is output at the end of the batch
+void print_metric(char *device, metric *m, double value) {
+	if (output_format != FORMAT_TEXT) {
+		record_metric(device, m, value);
+		return;
+	}
+
+	if (device != NULL) fprintf(out, "%s: ", device);
+	if (plain_output == 0) {
+		if (m->unit != NULL) fprintf(out, "%s (%s): ", m->label, m->unit);
+		else fprintf(out, "%s: ", m->label);
+	}
+
+	char text[32];
+	format_metric(m, value, text, sizeof(text));
+	fprintf(out, "%s\n", text);
+}
+
+// Formats a value as in text output
+void format_metric(metric *m, double value, char *buffer, int size) {
+	switch (m->type) {
+		case METRIC_ENUM:
+			snprintf(buffer, size, "%s", m->names[(int)value]);
+			break;
+		case METRIC_TIME:
+			snprintf(buffer, size, "%02d:%02d:%02d", (int)value / 3600, ((int)value / 60) % 60, (int)value % 60);
+			break;
+		default:
+			snprintf(buffer, size, "%.*f", m->precision, value);
+			break;
+	}
+}
+
+void record_metric(char *device, metric *m, double value) {
+	if (records_count == records_size) {
+		int size = (records_size == 0) ? 16 : records_size * 2;
+		output_record *resized = realloc(records, size * sizeof(output_record));
+		if (resized == NULL) {
+			fprintf(stderr, "Could not allocate memory: %s.\n", strerror(errno));
+			return;
+		}
+		records = resized;
+		records_size = size;
+	}
+
+	output_record *r = &records[records_count++];
+	r->device = device;
+	r->m = m;
+	r->value = value;
+	r->timestamp = realtime_ms();
+}
+
+// Outputs a string with characters special in JSON strings and Prometheus
+// label values escaped
+static void print_escaped(char *string) {
+	char *c;
+	for (c = string; *c != '\0'; c++) {
+		if ((*c == '"') || (*c == '\\')) fprintf(out, "\\%c", *c);
+		else if (*c == '\n') fprintf(out, "\\n");
+		else fputc(*c, out);
+	}
+}
+
+static void flush_csv() {
+	fprintf(out, "name,device,value,text,unit,timestamp\n");
+
+	int i;
+	for (i = 0; i < records_count; i++) {
+		output_record *r = &records[i];
+		char text[32] = "";
+		if (r->m->type != METRIC_NUMBER) format_metric(r->m, r->value, text, sizeof(text));
+
+		// Device file names with commas or quotes are not expected
+		fprintf(out, "%s,%s,%.*f,%s,%s,%lld.%03lld\n", r->m->name, (r->device != NULL) ? r->device : "", r->m->precision, r->value, text, (r->m->unit != NULL) ? r->m->unit : "", r->timestamp / 1000, r->timestamp % 1000);
+	}
+}
+
+static void flush_json() {
+	fprintf(out, "[");
+
+	int i;
+	for (i = 0; i < records_count; i++) {
+		output_record *r = &records[i];
+		fprintf(out, "%s\n  {\"name\": \"%s\", ", (i > 0) ? "," : "", r->m->name);
+		if (r->device != NULL) {
+			fprintf(out, "\"device\": \"");
+			print_escaped(r->device);
+			fprintf(out, "\", ");
+		}
+		fprintf(out, "\"value\": %.*f, ", r->m->precision, r->value);
+		if (r->m->type != METRIC_NUMBER) {
+			char text[32];
+			format_metric(r->m, r->value, text, sizeof(text));
+			fprintf(out, "\"text\": \"%s\", ", text);
+		}
+		if (r->m->unit != NULL) fprintf(out, "\"unit\": \"%s\", ", r->m->unit);
+		else fprintf(out, "\"unit\": null, ");
+		fprintf(out, "\"timestamp\": %lld.%03lld}", r->timestamp / 1000, r->timestamp % 1000);
+	}
+
+	fprintf(out, "%s]\n", (records_count > 0) ? "\n" : "");
+}
+
+// Samples of the same metric have to be together, after its HELP and TYPE
+// lines; timestamps are not output as node_exporter textfile collector does
+// not accept them
+static void flush_prom() {
+	int i;
+	int j;
+	for (i = 0; i < records_count; i++) {
+		for (j = 0; (j < i) && (records[j].m != records[i].m); j++);
+		if (j < i) continue;
+
+		metric *m = records[i].m;
+		if (m->unit != NULL) fprintf(out, "# HELP %s%s %s (%s)\n", OUTPUT_PREFIX, m->name, m->label, m->unit);
+		else fprintf(out, "# HELP %s%s %s\n", OUTPUT_PREFIX, m->name, m->label);
+		fprintf(out, "# TYPE %s%s gauge\n", OUTPUT_PREFIX, m->name);
+
+		for (j = i; j < records_count; j++) {
+			output_record *r = &records[j];
+			if (r->m != m) continue;
+
+			fprintf(out, "%s%s", OUTPUT_PREFIX, m->name);
+			if (r->device != NULL) {
+				fprintf(out, "{device=\"");
+				print_escaped(r->device);
+				fprintf(out, "\"}");
+			}
+			fprintf(out, " %.*f\n", m->precision, r->value);
+		}
+	}
+}
+
+// Outputs collected values in the output format and forgets them
+void flush_metrics() {
+	if (records_count == 0) return;
+
+	switch (output_format) {
+		case FORMAT_CSV:
+			flush_csv();
+			break;
+		case FORMAT_JSON:
+			flush_json();
+			break;
+		case FORMAT_PROM:
+			flush_prom();
+			break;
+	}
+
+	records_count = 0;
+}
@@ -0,0 +1,26 @@
+#ifndef OUTPUT_H_
+#define OUTPUT_H_
+
+#include <stdio.h>
+
+#include "metric.h"
+
+#define OUTPUT_PREFIX "solar_" // Of Prometheus metric names
+
+// Value of a metric output in a machine-readable format at the end of a batch
+typedef struct {
+	char *device; // NULL if there is only one
+	metric *m;
+	double value;
+	long long timestamp; // Milliseconds since the epoch
+} output_record;
+
+extern char *format_names[];
+
+int parse_format(char *name);
+void format_metric(metric *m, double value, char *buffer, int size);
+void record_metric(char *device, metric *m, double value);
+void print_metric(char *device, metric *m, double value);
+void flush_metrics();
+
+#endif /* OUTPUT_H_ */
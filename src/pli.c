@@ -5,245 +5,236 @@
 #include <string.h>
 #include <time.h>
 #include <fcntl.h>
+#include <math.h>
+#include <termios.h>
+#include <limits.h>
 
 #include "pli.h"
+#include "protocol.h"
 #include "main.h"
+#include "serial.h"
+#include "snapshot.h"
+#include "ringlog.h"
+#include "metric.h"
+#include "dump.h"
+#include "profile.h"
+#include "history.h"
+#include "energy.h"
+#include "scheduler.h"
+#include "watch.h"
+#include "clocksync.h"
+#include "output.h"
 
 command pli_commands[] = {
 	{"test", "loopback test connection to PLI", pli_test},
+	{"probe", "find the fastest working baud and use it from now on", pli_probe, 0, COMMAND_CHANGES | COMMAND_FILES},
 	{"plversion", "get PL software version", pli_plversion},
 	{"getday", "get current day in a month", pli_getday},
 	{"gettime", "get current time", pli_gettime},
-	{"setdaytime", "set current day and time from local time on this system", pli_setdaytime},
+	{"setdaytime", "set current day and time from local time on this system", pli_setdaytime, 0, COMMAND_CHANGES},
+	{"syncclock", "set current day and time from local time on this system only if they drifted", pli_syncclock, 0, COMMAND_CHANGES},
 	{"batcapacity", "get battery capacity configuration", pli_batcapacity},
 	{"batvoltage", "get current battery voltage", pli_batvoltage},
 	{"solvoltage", "get current solar voltage", pli_solvoltage},
 	{"charge", "get current charging current", pli_charge},
 	{"load", "get current load current", pli_load},
 	{"state", "get current regulator state", pli_state},
-	{"save", "save current configuration to 'solar.conf'", pli_save},
-	{"restore", "restore configuration from 'solar.conf'", pli_restore},
-	{"powercycle", "switch power off to be (possibly) turned automatically back on", pli_powercycle},
+	{"save", "save current configuration to 'solar.conf'", pli_save, 0, COMMAND_FILES},
+	{"restore", "restore changed configuration from 'solar.conf'", pli_restore, 0, COMMAND_CHANGES},
+	{"powercycle", "switch power off to be (possibly) turned automatically back on", pli_powercycle, 0, COMMAND_CHANGES},
+	{"sample", "continuously sample values into a shared memory snapshot", pli_sample, 0, COMMAND_ENDLESS},
+	{"schedule", "continuously read values into a shared memory snapshot, each as often as it changes", pli_schedule, 0, COMMAND_ENDLESS},
+	{"monitor", "continuously sample registers into a ring buffer log file", pli_monitor, 0, COMMAND_ENDLESS | COMMAND_FILES},
+	{"energy", "continuously integrate charge and load into Ah and Wh totals in a state file", pli_energy, 0, COMMAND_ENDLESS | COMMAND_FILES},
+	{"dumpram", "dump processor memory into 'solar.ram' (or file given with -f)", pli_dumpram, 0, COMMAND_FILES},
+	{"dumpeeprom", "dump EEPROM into 'solar.eeprom' (or file given with -f)", pli_dumpeeprom, 0, COMMAND_FILES},
+	{"history", "output daily log of days which ended since the last run", pli_history, 0, COMMAND_FILES},
+	{"get", "get values of metrics given as arguments (without them lists metrics)", pli_get, 1},
+	{"watch", "output changes of metrics given as <metric>[:<deadband>][@<threshold>,...][~<hysteresis>] arguments", pli_watch, 1, COMMAND_ENDLESS},
 	{NULL, NULL}
 };
 
-int write_buffer(int fd, unsigned char *buffer) {
-	int count;
-	int i = 0;
-	int w = 0;
-
-	// Will wait IO_WAIT seconds for the write
-	alarm(IO_WAIT);
-
-	while ((count = write(fd, buffer + w, sizeof(buffer) - w)) != sizeof(buffer) - w) {
-		if (count == -1) {
-			fprintf(stderr, "Could not write command: %s.\n", strerror(errno));
-
-			// Disables alarm
-			alarm(0);
-
-			return 2;
-		}
-		else if (i < RETRY) {
-			w =+ count;
-			i++;
-		}
-		else {
-			fprintf(stderr, "Could not write complete command buffer.\n");
-
-			// Disables alarm
-			alarm(0);
-
-			return 2;
-		}
-	}
-
-	// Disables alarm
-	alarm(0);
-
-	// Communication with PLI can immediately follow (read syscall is successful)
-	// but if PLI does not have data from the regulator yet it returns sent buffer
-	// We wait approximately 200 ms as specified in the documentation, probably
-	// could wait less
-	usleep(200000);
-
-	return 0;
-}
-
-int read_buffer(int fd, unsigned char *buffer, int size) {
-	int count;
-	int i = 0;
-	int r = 0;
-
-	// Will wait IO_WAIT seconds for the write
-	alarm(IO_WAIT);
-
-	while ((count = read(fd, buffer + r, size - r)) != size - r) {
-		if (count == -1) {
-			fprintf(stderr, "Could not read response: %s.\n", strerror(errno));
-
-			// Disables alarm
-			alarm(0);
-
-			return 2;
-		}
-		else if (i < RETRY) {
-			r += count;
-			i++;
-		}
-		else {
-			fprintf(stderr, "Could not read complete response buffer.\n");
-
-			// Disables alarm
-			alarm(0);
-
-			return 2;
-		}
-	}
-
-	// Disables alarm
-	alarm(0);
-
-	return 0;
-}
-
 void printerror(unsigned char code) {
 	if (plain_output != 0) return;
 
-	fprintf(stdout, "Command failed");
+	fprintf(out, "Command failed");
 	switch (code) {
 		case 0x81:
-			fprintf(stdout, ": timeout error.\n");
+			fprintf(out, ": timeout error.\n");
 			break;
 		case 0x82:
-			fprintf(stdout, ": checksum error in PLI receive data.\n");
+			fprintf(out, ": checksum error in PLI receive data.\n");
 			break;
 		case 0x83:
-			fprintf(stdout, ": command received by PLI is not recognised.\n");
+			fprintf(out, ": command received by PLI is not recognised.\n");
 			break;
 		case 0x85:
-			fprintf(stdout, ": processor did not receive a reply to request.\n");
+			fprintf(out, ": processor did not receive a reply to request.\n");
 			break;
 		case 0x86:
-			fprintf(stdout, ": error in reply from PL.\n");
+			fprintf(out, ": error in reply from PL.\n");
 			break;
 		default:
-			fprintf(stdout, ".\n");
+			fprintf(out, ".\n");
 			break;
 	}
 }
 
-int read_processor(int fd, int location) {
-	unsigned char buffer[] = {0x14, location, 0x00, 0x14 ^ 0xFF};
+// Reports failures of the protocol layer as they happen
+void report_failure(solar_ctx *ctx) {
+	switch (ctx->error) {
+		case SOLAR_EPLI:
+			printerror(ctx->code);
+			break;
+		case SOLAR_ENOMEM:
+		case SOLAR_EWRITE:
+		case SOLAR_EREAD:
+			fprintf(stderr, "%s: %s.\n", solar_strerror(ctx->error), strerror(ctx->errnum));
+			break;
+		default:
+			fprintf(stderr, "%s.\n", solar_strerror(ctx->error));
+			break;
+	}
+}
 
-	if (write_buffer(fd, buffer)) return -1;
-	if (read_buffer(fd, buffer, 2)) return -1;
+// Restores device state at the end of a session
+int pli_finish(solar_ctx *ctx) {
+	return (finish_session(ctx) == -1) ? 3 : 0;
+}
 
-	if (buffer[0] == 0xC8) {
-		return buffer[1];
-	}
-	else {
-		printerror(buffer[0]);
-		return -1;
-	}
+// Reads values of metrics from the regulator or the shared memory snapshot
+static int get_metrics(solar_ctx *ctx, metric *metrics[], int count, double values[]) {
+	if (use_snapshot != 0) return read_snapshot_metrics(metrics, count, values);
+	return read_metrics(ctx, metrics, count, values);
 }
 
-int read_eprom(int fd, int location) {
-	unsigned char buffer[] = {0x48, location, 0x00, 0x48 ^ 0xFF};
+int pli_test(solar_ctx *ctx) {
+	unsigned char frame[FRAME_SIZE];
+	pli_reply reply;
+	encode_request(frame, OP_LOOPBACK, 0x00, 0x00);
 
-	if (write_buffer(fd, buffer)) return -1;
-	if (read_buffer(fd, buffer, 2)) return -1;
+	if (exchange(ctx, frame, &reply, 1) == -1) return 3;
 
-	if (buffer[0] == 0xC8) {
-		return buffer[1];
+	if (reply.kind == REPLY_ACK) {
+		if (plain_output == 0) fprintf(out, "Test successful.\n");
+		return 0;
 	}
 	else {
-		printerror(buffer[0]);
-		return -1;
+		if (plain_output == 0) fprintf(out, "Test failed.\n");
+		return 3;
 	}
 }
 
-int write_processor(int fd, int location, unsigned char data) {
-	unsigned char buffer[] = {0x98, location, data, 0x98 ^ 0xFF};
-
-	if (write_buffer(fd, buffer)) return -1;
-
-	return 0;
-}
-
-int write_eprom(int fd, int location, unsigned char data) {
-	unsigned char buffer[] = {0xCA, location, data, 0xCA ^ 0xFF};
-
-	if (write_buffer(fd, buffer)) return -1;
-
-	return 0;
+// Baud rates tried by the probe command, fastest first
+static int probe_rates[] = {230400, 115200, 57600, 38400, 19200, 9600, 4800, 2400, 1200, 0};
+
+// Measures mean round trip of loopback commands in milliseconds, -1 if any of
+// them fails
+static double probe_rate(solar_ctx *ctx) {
+	struct timespec start;
+	struct timespec end;
+	double total = 0;
+	int round;
+	for (round = 0; round < PROBE_ROUNDS; round++) {
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		if (loopback(ctx) != RECEIVE_OK) return -1;
+		clock_gettime(CLOCK_MONOTONIC, &end);
+		total += (end.tv_sec - start.tv_sec) * 1000.0 + (end.tv_nsec - start.tv_nsec) / 1000000.0;
+	}
+	return total / PROBE_ROUNDS;
 }
 
-int long_push(int fd) {
-	unsigned char buffer[] = {0x57, 0x02, 0x00, 0x57 ^ 0xFF};
-
-	if (write_buffer(fd, buffer)) return -1;
-
-	return 0;
-}
+// Tries loopback commands at every baud rate and stores the fastest one at
+// which all of them succeed in the link profile of the device, which later
+// runs then use; the session continues at that baud
+int pli_probe(solar_ctx *ctx) {
+	struct termios original;
+	if (tcgetattr(ctx->fd, &original) == -1) {
+		fprintf(stderr, "Could not get serial port parameters: %s.\n", strerror(errno));
+		return 2;
+	}
 
-int short_push(int fd) {
-	unsigned char buffer[] = {0x57, 0x01, 0x00, 0x57 ^ 0xFF};
+	// At a wrong baud there is usually no response at all
+	int timeout = ctx->reply_timeout;
+	if (ctx->reply_timeout > PROBE_TIMEOUT) ctx->reply_timeout = PROBE_TIMEOUT;
 
-	if (write_buffer(fd, buffer)) return -1;
+	link_profile profile;
+	memset(&profile, 0, sizeof(profile));
+	int i;
+	for (i = 0; probe_rates[i] != 0; i++) {
+		struct termios params = original;
+		cfsetspeed(&params, serialspeed(probe_rates[i]));
+		if (tcsetattr(ctx->fd, TCSADRAIN, &params) == -1) {
+			fprintf(stderr, "Could not set serial port parameters: %s.\n", strerror(errno));
+			break;
+		}
+		drain(ctx);
 
-	return 0;
-}
+		double latency = probe_rate(ctx);
+		if (plain_output == 0) {
+			if (latency < 0) fprintf(out, "Baud %d: no response.\n", probe_rates[i]);
+			else fprintf(out, "Baud %d: %.1f ms round trip.\n", probe_rates[i], latency);
+		}
 
-int pli_test(int fd) {
-	unsigned char buffer[] = {0xBB, 0x00, 0x00, 0xBB ^ 0xFF};
+		if ((latency >= 0) && (profile.baud == 0)) {
+			profile.baud = probe_rates[i];
+			profile.latency = latency;
+		}
+	}
 
-	if (write_buffer(fd, buffer)) return 3;
-	if (read_buffer(fd, buffer, 1)) return 3;
+	ctx->reply_timeout = timeout;
 
-	if (buffer[0] == 0x80) {
-		if (plain_output == 0) fprintf(stdout, "Test successful.\n");
-		return 0;
+	struct termios params = original;
+	if (profile.baud != 0) cfsetspeed(&params, serialspeed(profile.baud));
+	if (tcsetattr(ctx->fd, TCSADRAIN, &params) == -1) {
+		fprintf(stderr, "Could not set serial port parameters: %s.\n", strerror(errno));
+		return 2;
 	}
-	else {
-		if (plain_output == 0) fprintf(stdout, "Test failed.\n");
+	drain(ctx);
+
+	if (profile.baud == 0) {
+		if (plain_output == 0) fprintf(out, "Probe failed.\n");
 		return 3;
 	}
-}
 
-int pli_plversion(int fd) {
-	int version;
-	if ((version = read_processor(fd, 0x00)) == -1) {
-		return 3;
+	char path[PATH_MAX];
+	profile.probed = time(NULL);
+	if (profile_path(device, path, sizeof(path)) == -1) {
+		fprintf(stderr, "Link profile path of '%s' is too long.\n", device);
+		return 2;
 	}
+	if (save_profile(path, &profile) == -1) return 2;
+
+	if (plain_output == 0) fprintf(out, "Using baud %d, saved into '%s'.\n", profile.baud, path);
+	else fprintf(out, "%d\n", profile.baud);
 
-	fprintf(stdout, "%s%d\n", ((plain_output != 0) ? "" : "Version: "), version);
 	return 0;
 }
 
-int pli_getday(int fd) {
-	int day;
-	if ((day = read_processor(fd, 0x31)) == -1) return 3;
+// Outputs value of the named metric
+static int print_named(solar_ctx *ctx, char *name) {
+	metric *m = find_metric(pli_metrics, name);
+	double value;
+
+	if (get_metrics(ctx, &m, 1, &value) == -1) return 3;
 
-	fprintf(stdout, "%s%d\n", ((plain_output != 0) ? "" : "Day: "), day);
+	print_metric(NULL, m, value);
 	return 0;
 }
 
-int pli_gettime(int fd) {
-	int hour;
-	if ((hour = read_processor(fd, 0x30)) == -1) return 3;
-
-	int min;
-	if ((min = read_processor(fd, 0x2F)) == -1) return 3;
+int pli_plversion(solar_ctx *ctx) {
+	return print_named(ctx, "plversion");
+}
 
-	int sec;
-	if ((sec = read_processor(fd, 0x2E)) == -1) return 3;
+int pli_getday(solar_ctx *ctx) {
+	return print_named(ctx, "day");
+}
 
-	fprintf(stdout, "%s%02d:%02d:%02d\n", ((plain_output != 0) ? "" : "Time: "), hour / 10, ((hour % 10) * 6) + min, sec);
-	return 0;
+int pli_gettime(solar_ctx *ctx) {
+	return print_named(ctx, "time");
 }
 
-int pli_setdaytime(int fd) {
+int pli_setdaytime(solar_ctx *ctx) {
 	time_t rawtime;
 	if (time(&rawtime) == -1) {
 		fprintf(stderr, "Could not get local time: %s.\n", strerror(errno));
@@ -251,117 +242,89 @@ int pli_setdaytime(int fd) {
 	}
 	struct tm *timeinfo = localtime(&rawtime);
 
-	if (write_processor(fd, 0x31, timeinfo->tm_mday - 1) == -1) return 3;
-	if (write_processor(fd, 0x30, (timeinfo->tm_hour * 10) + (timeinfo->tm_min / 6)) == -1) return 3;
-	if (write_processor(fd, 0x2F, timeinfo->tm_min % 6) == -1) return 3;
-	if (write_processor(fd, 0x2E, timeinfo->tm_sec) == -1) return 3;
+	if (write_processor(ctx, 0x31, timeinfo->tm_mday - 1) == -1) return 3;
+	if (write_processor(ctx, 0x30, (timeinfo->tm_hour * 10) + (timeinfo->tm_min / 6)) == -1) return 3;
+	if (write_processor(ctx, 0x2F, timeinfo->tm_min % 6) == -1) return 3;
+	if (write_processor(ctx, 0x2E, timeinfo->tm_sec) == -1) return 3;
 
 	return 0;
 }
 
-int pli_batcapacity(int fd) {
-	int bcap;
-	if ((bcap = read_processor(fd, 0x5E)) == -1) return 3;
-
-	fprintf(stdout, "%s%d\n", ((plain_output != 0) ? "" : "Battery capacity (Ah): "), ((bcap <= 50) ? (bcap * 20) : ((bcap - 50) * 100)));
-	return 0;
+int pli_batcapacity(solar_ctx *ctx) {
+	return print_named(ctx, "batcapacity");
 }
 
-int pli_batvoltage(int fd) {
-	int vdiv;
-	if ((vdiv = read_processor(fd, 0x20)) == -1) return 3;
-
-	int batv;
-	if ((batv = read_processor(fd, 0x32)) == -1) return 3;
-
-	batv = batv * (vdiv + 1);
-	fprintf(stdout, "%s%.1f\n", ((plain_output != 0) ? "" : "Battery voltage (V): "), (double)batv / 10.0);
-	return 0;
+int pli_batvoltage(solar_ctx *ctx) {
+	return print_named(ctx, "batvoltage");
 }
 
-int pli_solvoltage(int fd) {
-	// Repeats three times to be sure
-	if (write_processor(fd, 0x29, 0x00) == -1) return 3; // Wakes up the display
-	if (write_processor(fd, 0x29, 0x00) == -1) return 3; // Wakes up the display
-	if (write_processor(fd, 0x29, 0x00) == -1) return 3; // Wakes up the display
-
-	if (write_processor(fd, 0x66, 0x27) == -1) return 3; // Selects solv display
-
-	// Sleeps three seconds for measurement to stabilize
-	sleep(3);
-
-	int solv;
-	if ((solv = read_processor(fd, 0x35)) == -1) return 3;
-
-	if (write_processor(fd, 0x66, 0x00) == -1) return 3; // Selects initial display
-
-	// Repeats three times to be sure
-	if (write_processor(fd, 0x29, 0x10) == -1) return 3; // Puts the display to sleep
-	if (write_processor(fd, 0x29, 0x10) == -1) return 3; // Puts the display to sleep
-	if (write_processor(fd, 0x29, 0x10) == -1) return 3; // Puts the display to sleep
-
-	fprintf(stdout, "%s%.1f\n", ((plain_output != 0) ? "" : "Solar voltage (V): "), (double)solv / 2.0);
-	return 0;
+int pli_solvoltage(solar_ctx *ctx) {
+	return print_named(ctx, "solvoltage");
 }
 
-int pli_charge(int fd) {
-	int cint;
-	if ((cint = read_processor(fd, 0xD5)) == -1) return 3;
-
-	int cext;
-	if ((cext = read_processor(fd, 0xCD)) == -1) return 3;
-
-	int extf;
-	if ((extf = read_processor(fd, 0xCF)) == -1) return 3;
+int pli_charge(solar_ctx *ctx) {
+	return print_named(ctx, "charge");
+}
 
-	fprintf(stdout, "%s%.1f\n", ((plain_output != 0) ? "" : "Charging current (A): "), (double)cint / INTCHARGE_DIV + (double)cext / (((extf & 0x01) == 0) ? 10.0 : 1.0));
-	return 0;
+int pli_load(solar_ctx *ctx) {
+	return print_named(ctx, "load");
 }
 
-int pli_load(int fd) {
-	int lint;
-	if ((lint = read_processor(fd, 0xD9)) == -1) return 3;
+int pli_state(solar_ctx *ctx) {
+	return print_named(ctx, "state");
+}
 
-	int lext;
-	if ((lext = read_processor(fd, 0xCE)) == -1) return 3;
+// Outputs values of metrics given as arguments, all decoded from one read of
+// registers they depend on, or lists available metrics without arguments
+int pli_get(solar_ctx *ctx) {
+	metric *m;
+	int i;
 
-	int extf;
-	if ((extf = read_processor(fd, 0xCF)) == -1) return 3;
+	if (arguments_count == 0) {
+		for (m = pli_metrics; m->name != NULL; m++) {
+			if (plain_output != 0) fprintf(out, "%s\n", m->name);
+			else if (m->unit != NULL) fprintf(out, "%-12s  %s (%s)\n", m->name, m->label, m->unit);
+			else fprintf(out, "%-12s  %s\n", m->name, m->label);
+		}
+		return 0;
+	}
 
-	fprintf(stdout, "%s%.1f\n", ((plain_output != 0) ? "" : "Load current (A): "), (double)lint / INTLOAD_DIV + (double)lext / (((extf & 0x02) == 0) ? 10.0 : 1.0));
-	return 0;
-}
+	metric *metrics[arguments_count];
+	double values[arguments_count];
+	for (i = 0; i < arguments_count; i++) {
+		if ((metrics[i] = find_metric(pli_metrics, arguments[i])) == NULL) {
+			fprintf(stderr, "Unsupported metric '%s'.\n", arguments[i]);
+			return 1;
+		}
+	}
 
-int pli_state(int fd) {
-	int rstate;
-	if ((rstate = read_processor(fd, 0x65)) == -1) return 3;
+	get_metrics(ctx, metrics, arguments_count, values);
 
-	char *state;
-	switch (rstate & 0x03) {
-		case 0:
-			state = "boost";
-			break;
-		case 1:
-			state = "equalize";
-			break;
-		case 2:
-			state = "absorption";
-			break;
-		case 3:
-			state = "float";
-			break;
+	// Stops at the first failed value so that plain output lines still match
+	// the order of given metrics
+	for (i = 0; i < arguments_count; i++) {
+		if (isnan(values[i])) return 3;
+		print_metric(NULL, metrics[i], values[i]);
 	}
-	fprintf(stdout, "%s%s\n", ((plain_output != 0) ? "" : "Regulator state: "), state);
+
 	return 0;
 }
 
-int pli_save(int fd) {
+int pli_save(solar_ctx *ctx) {
 	unsigned char buffer[CONFIGURATION_SIZE];
+	unsigned char locations[CONFIGURATION_SIZE];
+	int values[CONFIGURATION_SIZE];
 	int i;
-	int val;
 	for (i = CONFIGURATION_START; i <= CONFIGURATION_END; i++) {
-		if ((val = read_eprom(fd, i)) == -1) return 3;
-		buffer[i - CONFIGURATION_START] = val;
+		locations[i - CONFIGURATION_START] = i;
+	}
+
+	if (read_registers(ctx, 0x48, locations, values, CONFIGURATION_SIZE) == -1) return 3;
+
+	for (i = CONFIGURATION_START; i <= CONFIGURATION_END; i++) {
+		// Reads again a register rejected with an error code to report it
+		if ((values[i - CONFIGURATION_START] == -1) && ((values[i - CONFIGURATION_START] = read_eprom(ctx, i)) == -1)) return 3;
+		buffer[i - CONFIGURATION_START] = values[i - CONFIGURATION_START];
 	}
 
 	int file;
@@ -373,13 +336,14 @@ int pli_save(int fd) {
 	int count;
 	int w = 0;
 
+	i = 0;
 	while ((count = write(file, buffer + w, sizeof(buffer) - w)) != sizeof(buffer) - w) {
 		if (count == -1) {
 			fprintf(stderr, "Could not write configuration file 'solar.conf': %s.\n", strerror(errno));
 			return 2;
 		}
 		else if (i < RETRY) {
-			w =+ count;
+			w += count;
 			i++;
 		}
 		else {
@@ -396,7 +360,7 @@ int pli_save(int fd) {
 	return 0;
 }
 
-int pli_restore(int fd) {
+int pli_restore(solar_ctx *ctx) {
 	int file;
 	if ((file = open("solar.conf", O_RDONLY)) == -1) {
 		fprintf(stderr, "Could not open configuration file 'solar.conf': %s.\n", strerror(errno));
@@ -428,10 +392,53 @@ int pli_restore(int fd) {
 		return 2;
 	}
 
+	// Only bytes which differ from current configuration are written, so that we
+	// do not wear EEPROM needlessly
+	unsigned char locations[CONFIGURATION_SIZE];
+	int current[CONFIGURATION_SIZE];
 	for (i = CONFIGURATION_START; i <= CONFIGURATION_END; i++) {
-		if (write_eprom(fd, i, buffer[i - CONFIGURATION_START]) == -1) return 3;
+		locations[i - CONFIGURATION_START] = i;
 	}
 
+	if (read_registers(ctx, 0x48, locations, current, CONFIGURATION_SIZE) == -1) return 3;
+
+	int changed = 0;
+	for (i = CONFIGURATION_START; i <= CONFIGURATION_END; i++) {
+		int j = i - CONFIGURATION_START;
+
+		// Reads again a register rejected with an error code to report it
+		if ((current[j] == -1) && ((current[j] = read_eprom(ctx, i)) == -1)) return 3;
+		if (current[j] == buffer[j]) continue;
+
+		// Every written byte is read back to verify it, for a while as the
+		// write can still be in progress, and written again only if it never
+		// reads back so that EEPROM is not worn by rewriting it too early
+		int value = -1;
+		int attempt;
+		for (attempt = 0; (attempt < VERIFY_RETRY) && (value != buffer[j]); attempt++) {
+			if (attempt > 0) ctx->stats.retries++;
+			if (write_eprom(ctx, i, buffer[j]) == -1) return 3;
+
+			long long deadline = monotonic_ms() + VERIFY_TIMEOUT;
+			while (((value = read_eprom(ctx, i)) != buffer[j]) && (monotonic_ms() < deadline)) {
+				if (value == -1) return 3;
+				sleep_ms(VERIFY_WAIT);
+			}
+			if (value == -1) return 3;
+		}
+
+		if (value != buffer[j]) {
+			fprintf(stderr, "Could not restore configuration at 0x%02X: wrote 0x%02X but read 0x%02X.\n", i, buffer[j], value);
+			return 3;
+		}
+
+		if (plain_output != 0) fprintf(out, "%02X %02X %02X\n", i, current[j], buffer[j]);
+		else fprintf(out, "%02X: %02X -> %02X\n", i, current[j], buffer[j]);
+		changed++;
+	}
+
+	if (plain_output == 0) fprintf(out, "Restored %d of %d configuration bytes.\n", changed, CONFIGURATION_SIZE);
+
 	return 0;
 }
 
@@ -439,23 +446,84 @@ int pli_restore(int fd) {
 // before it switches power back on
 // It works only if battery voltage is over LON, otherwise the power will stay
 // off until battery voltage reaches LON
-int pli_powercycle(int fd) {
-	// Repeats three times to be sure
-	if (write_processor(fd, 0x29, 0x00) == -1) return 3; // Wakes up the display
-	if (write_processor(fd, 0x29, 0x00) == -1) return 3; // Wakes up the display
-	if (write_processor(fd, 0x29, 0x00) == -1) return 3; // Wakes up the display
+int pli_powercycle(solar_ctx *ctx) {
+	if (select_display(ctx, 0x17) == -1) return 3; // Selects lset display
 
-	if (write_processor(fd, 0x66, 0x17) == -1) return 3; // Selects lset display
-
-	if (long_push(fd) == -1) return 3; // Sends a long push command
+	if (long_push(ctx) == -1) return 3; // Sends a long push command
 
 	// Will probably never reach the regulator if this program is running on a system
-	// powered by the regulator as system's power will be turned off
+	// powered by the regulator as system's power will be turned off, display
+	// is put to sleep at the end of the session
+
+	return 0;
+}
+
+// Samples values every interval seconds and stores them into a shared memory
+// snapshot from which they can be read without accessing the serial port
+int pli_sample(solar_ctx *ctx) {
+	snapshot *shared;
+	if ((shared = open_snapshot(1)) == NULL) return 2;
+
+	metric *metrics[SNAPSHOT_SAMPLED];
+	int i;
+	for (i = 0; i < SNAPSHOT_SAMPLED; i++) {
+		metrics[i] = find_metric(pli_metrics, snapshot_names[i]);
+	}
+
+	while (1) {
+		long long start = monotonic_ms();
+
+		// Every sample reads fresh values
+		invalidate_cache(ctx);
+
+		double values[SNAPSHOT_SAMPLED];
+		get_metrics(ctx, metrics, SNAPSHOT_SAMPLED, values);
+		for (i = 0; i < SNAPSHOT_SAMPLED; i++) {
+			if (!isnan(values[i])) write_snapshot(shared, i, values[i]);
+		}
+
+		// Display is not kept awake between samples
+		pli_finish(ctx);
+
+		sleep_ms(start + interval * 1000LL - monotonic_ms());
+	}
+
+	return 0;
+}
 
-	// Repeats three times to be sure
-	if (write_processor(fd, 0x29, 0x10) == -1) return 3; // Puts the display to sleep
-	if (write_processor(fd, 0x29, 0x10) == -1) return 3; // Puts the display to sleep
-	if (write_processor(fd, 0x29, 0x10) == -1) return 3; // Puts the display to sleep
+// Samples registers every interval seconds into a ring buffer log file
+int pli_monitor(solar_ctx *ctx) {
+	ringlog *log;
+	if ((log = open_ringlog(1)) == NULL) return 2;
+
+	while (1) {
+		long long start = monotonic_ms();
+
+		// Every sample reads fresh values
+		invalidate_cache(ctx);
+
+		ringlog_record record;
+		memset(&record, 0, sizeof(record));
+
+		struct timespec now;
+		clock_gettime(CLOCK_REALTIME, &now);
+		record.seconds = now.tv_sec;
+		record.milliseconds = now.tv_nsec / 1000000;
+
+		// Registers are not read one by one when the link is down
+		int linked = (prefetch_processor(ctx, log->header.registers, log->header.registers_count) != -1);
+
+		int i;
+		int value;
+		for (i = 0; i < log->header.registers_count; i++) {
+			if ((linked == 0) || ((value = read_processor(ctx, log->header.registers[i])) == -1)) record.missing |= 1 << i;
+			else record.values[i] = value;
+		}
+
+		append_ringlog(log, &record);
+
+		sleep_ms(start + interval * 1000LL - monotonic_ms());
+	}
 
 	return 0;
 }
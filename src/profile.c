@@ -0,0 +1,57 @@
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <errno.h>
+#include <sys/stat.h>
+
+#include "profile.h"
+#include "main.h"
+#include "files.h"
+
+// Link profiles are small files with a 'key=value' line for every parameter,
+// one for every serial port device, so that later runs use the baud found by
+// the probe command without it being given
+
+// Profile file of a device is given with --profile or derived from its path,
+// with slashes replaced by underscores
+int profile_path(char *device, char *path, int size) {
+	if (profile_file != NULL) return (snprintf(path, size, "%s", profile_file) >= size) ? -1 : 0;
+
+	if (snprintf(path, size, "%s/%s", PROFILE_DIR, device) >= size) return -1;
+
+	char *c;
+	for (c = path + strlen(PROFILE_DIR) + 1; *c != '\0'; c++) {
+		if (*c == '/') *c = '_';
+	}
+	return 0;
+}
+
+static void set_profile(void *data, char *key, char *value) {
+	link_profile *profile = data;
+	if (strcmp(key, "baud") == 0) profile->baud = strtol(value, NULL, 10);
+	else if (strcmp(key, "latency") == 0) profile->latency = strtod(value, NULL);
+	else if (strcmp(key, "probed") == 0) profile->probed = strtoll(value, NULL, 10);
+}
+
+// Returns -1 if there is no valid profile, without reporting it, as then
+// defaults are used
+int load_profile(char *path, link_profile *profile) {
+	memset(profile, 0, sizeof(link_profile));
+	if (read_keys(path, set_profile, profile) == -1) return -1;
+
+	return (profile->baud > 0) ? 0 : -1;
+}
+
+// Replaces the previous profile atomically, so that concurrent runs never
+// read a partially written profile
+int save_profile(char *path, link_profile *profile) {
+	char contents[PROFILE_SIZE];
+	snprintf(contents, sizeof(contents), "baud=%d\nlatency=%.1f\nprobed=%lld\n", profile->baud, profile->latency, profile->probed);
+
+	if ((profile_file == NULL) && (mkdir(PROFILE_DIR, 0755) == -1) && (errno != EEXIST)) {
+		fprintf(stderr, "Could not create link profile directory '%s': %s.\n", PROFILE_DIR, strerror(errno));
+		return -1;
+	}
+
+	return replace_file(path, contents, "link profile");
+}
@@ -0,0 +1,18 @@
+#ifndef PROFILE_H_
+#define PROFILE_H_
+
+#define PROFILE_DIR "/var/cache/solar"
+#define PROFILE_SIZE 256
+
+// Link parameters of a serial port device found by the probe command
+typedef struct {
+	int baud;
+	double latency; // Mean loopback round trip in milliseconds
+	long long probed; // Seconds since the epoch
+} link_profile;
+
+int profile_path(char *device, char *path, int size);
+int load_profile(char *path, link_profile *profile);
+int save_profile(char *path, link_profile *profile);
+
+#endif /* PROFILE_H_ */
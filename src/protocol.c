@@ -0,0 +1,493 @@
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <termios.h>
+#include <sys/uio.h>
+
+#include "protocol.h"
+#include "serial.h"
+#include "metric.h"
+
+// PLI protocol: exchange of commands and responses with recovery from lost
+// data, registers with a cache, and metrics decoded from them
+// Failures are recorded in the context and reported through its report
+// function, nothing is output
+
+char *pli_states[] = {"boost", "equalize", "absorption", "float"};
+
+// Records a failure and reports it if the user of the context wants it
+void fail(solar_ctx *ctx, int error, int code) {
+	ctx->error = error;
+	ctx->errnum = errno;
+	ctx->code = code;
+	if (ctx->report != NULL) ctx->report(ctx);
+}
+
+// Any write can change regulator state so cached values are not valid anymore
+void invalidate_cache(solar_ctx *ctx) {
+	memset(ctx->processor_cached, 0, sizeof(ctx->processor_cached));
+}
+
+// Writes frames of count requests at once, as when filling a pipeline
+int write_frames(solar_ctx *ctx, unsigned char *frames[], int count) {
+	struct iovec iov[count];
+	int i;
+	for (i = 0; i < count; i++) {
+		iov[i].iov_base = frames[i];
+		iov[i].iov_len = FRAME_SIZE;
+	}
+
+	ctx->last_command = monotonic_ms();
+
+	// We wait only for the command to be transmitted, any waiting for the PLI
+	// is done when (and if) reading the response
+	if (writev_until(ctx->fd, iov, count, monotonic_ms() + ctx->reply_timeout) == -1) {
+		fail(ctx, SOLAR_EWRITE, 0);
+		return -1;
+	}
+	ctx->stats.written += count * FRAME_SIZE;
+
+	return 0;
+}
+
+int write_frame(solar_ctx *ctx, unsigned char frame[]) {
+	return write_frames(ctx, &frame, 1);
+}
+
+// Reads a reply to the command in request, which was sent at monotonic time
+// sent, and counts it in transport statistics
+// If PLI does not have data from the regulator yet it returns sent command
+// buffer first, so we skip such echoes and keep reading until the reply
+// arrives or the reply timeout passes
+// The first byte of a reply determines its length, and anything else than an
+// echo, a success code valid for the request or an error code means that we
+// are out of sync with the PLI
+// Returns RECEIVE_OK or the kind of failure, with errno set for RECEIVE_FAILED
+static int receive(solar_ctx *ctx, unsigned char *request, pli_reply *reply, long long sent) {
+	unsigned char frame[FRAME_SIZE];
+	long long deadline = monotonic_ms() + ctx->reply_timeout;
+	int expected = reply_size(request[0]);
+	int r = 0;
+
+	while (r < expected) {
+		int count = read_until(ctx->fd, frame + r, expected - r, deadline);
+		if (count == -1) {
+			if (errno != ETIMEDOUT) return RECEIVE_FAILED;
+			ctx->stats.timeouts++;
+
+			// Part of the response was lost
+			return (r == 0) ? RECEIVE_TIMEOUT : RECEIVE_DESYNC;
+		}
+		ctx->stats.read += count;
+		if (count < expected - r) ctx->stats.partial_reads++;
+		r += count;
+
+		int kind = reply_kind(request, frame[0]);
+		if (kind == REPLY_INVALID) return RECEIVE_DESYNC;
+
+		expected = reply_length(kind);
+		if (r < expected) continue;
+		if (decode_reply(request, frame, expected, reply) == -1) return RECEIVE_DESYNC;
+
+		if (kind == REPLY_ECHO) {
+			ctx->stats.echoes++;
+			expected = reply_size(request[0]);
+			r = 0;
+		}
+	}
+
+	count_latency(&ctx->stats, monotonic_ms() - sent);
+	if (reply->kind == REPLY_ERROR) count_error(&ctx->stats, reply->code);
+
+	return RECEIVE_OK;
+}
+
+// Records a failed exchange, reporting it only if report_errors is not zero
+static void receive_failed(solar_ctx *ctx, int result, int report_errors) {
+	int error = (result == RECEIVE_TIMEOUT) ? SOLAR_ETIMEOUT : ((result == RECEIVE_DESYNC) ? SOLAR_EDESYNC : SOLAR_EREAD);
+	if (report_errors != 0) {
+		fail(ctx, error, 0);
+		return;
+	}
+
+	ctx->error = error;
+	ctx->errnum = errno;
+}
+
+// Drops any input which is still in the buffer or arrives in DRAIN_WAIT
+// milliseconds, like responses after a failed pipelined exchange
+void drain(solar_ctx *ctx) {
+	unsigned char buffer[FRAME_SIZE * PIPELINE_MAX];
+	tcflush(ctx->fd, TCIFLUSH);
+
+	int count;
+	while ((count = read_until(ctx->fd, buffer, sizeof(buffer), monotonic_ms() + DRAIN_WAIT)) > 0) {
+		ctx->stats.read += count;
+	}
+}
+
+// Sends a loopback command, which PLI answers without the regulator
+// Returns RECEIVE_OK or the kind of failure
+int loopback(solar_ctx *ctx) {
+	unsigned char frame[FRAME_SIZE];
+	pli_reply reply;
+	encode_request(frame, OP_LOOPBACK, 0x00, 0x00);
+
+	if (write_until(ctx->fd, frame, FRAME_SIZE, monotonic_ms() + ctx->reply_timeout) == -1) return RECEIVE_FAILED;
+	ctx->stats.written += FRAME_SIZE;
+	ctx->last_command = monotonic_ms();
+
+	int result = receive(ctx, frame, &reply, ctx->last_command);
+	if ((result == RECEIVE_OK) && (reply.kind != REPLY_ACK)) return RECEIVE_DESYNC;
+	return result;
+}
+
+// Gets back in sync with the PLI after a failed exchange: waits (twice as
+// long every time, up to RECOVERY_BACKOFF_MAX), drops stale input and
+// verifies the link with a loopback command, up to RECOVERY_RETRY times
+// Returns -1 if the link could not be verified, with the result of the last
+// loopback command in result
+static int recover(solar_ctx *ctx, long long *backoff, int *result) {
+	int attempt;
+	for (attempt = 0; attempt < RECOVERY_RETRY; attempt++) {
+		ctx->stats.recoveries++;
+
+		sleep_ms(*backoff);
+		*backoff = (*backoff * 2 < RECOVERY_BACKOFF_MAX) ? (*backoff * 2) : RECOVERY_BACKOFF_MAX;
+		drain(ctx);
+
+		*result = loopback(ctx);
+		if (*result == RECEIVE_OK) return 0;
+		if (*result == RECEIVE_FAILED) return -1;
+	}
+	return -1;
+}
+
+// PLI did not get a response from the regulator or the command was corrupted
+static int transient(pli_reply *reply) {
+	return (reply->kind == REPLY_ERROR) && ((reply->code == 0x81) || (reply->code == 0x82) || (reply->code == 0x85) || (reply->code == 0x86));
+}
+
+// Sends a command and reads its reply, recovering from lost or corrupted
+// data up to RECOVERY_RETRY times before the command is sent again
+// Reply can be an error code if it persists, returns 0 if there is a reply
+// and errors are reported only if report_errors is not zero
+int exchange(solar_ctx *ctx, unsigned char *request, pli_reply *reply, int report_errors) {
+	long long backoff = RECOVERY_BACKOFF;
+	int attempt;
+	int result = RECEIVE_OK;
+
+	for (attempt = 0; attempt <= RECOVERY_RETRY; attempt++) {
+		if (attempt > 0) {
+			ctx->stats.retries++;
+
+			// After an error code we are still in sync with PLI
+			if ((result != RECEIVE_OK) && (recover(ctx, &backoff, &result) == -1)) break;
+		}
+
+		if (write_frame(ctx, request)) return -1;
+
+		result = receive(ctx, request, reply, ctx->last_command);
+		if ((result == RECEIVE_OK) && !transient(reply)) return 0;
+		if (result == RECEIVE_FAILED) break;
+	}
+
+	if (result == RECEIVE_OK) return 0;
+
+	receive_failed(ctx, result, report_errors);
+	return -1;
+}
+
+// Executes transactions in order, keeping up to pipeline depth commands in
+// flight, which are written together; responses are matched to commands in
+// order
+// If PLI does not keep up (a response does not arrive, is not in order or is an
+// error code) we fall back to one command at a time, which recovers from lost
+// data, and repeat the rest
+// Returns number of completed transactions, the rest is not attempted once the
+// link fails, which is reported
+int transact(solar_ctx *ctx, transaction *transactions, int count) {
+	int sent = 0;
+	int i = 0;
+
+	while (i < count) {
+		transaction *t = &transactions[i];
+
+		if (ctx->pipeline_depth == 1) {
+			if (reply_size(t->request[0]) == 0) {
+				if (write_frame(ctx, t->request)) return i;
+			}
+			else if (exchange(ctx, t->request, &t->reply, 1) == -1) {
+				return i;
+			}
+			sent = ++i;
+			continue;
+		}
+
+		unsigned char *frames[PIPELINE_MAX];
+		int n = 0;
+		while ((sent + n < count) && (sent + n - i < ctx->pipeline_depth)) {
+			frames[n] = transactions[sent + n].request;
+			n++;
+		}
+		if (n > 0) {
+			if (write_frames(ctx, frames, n)) return i;
+			for (; n > 0; n--) {
+				transactions[sent++].sent = ctx->last_command;
+			}
+		}
+
+		if ((reply_size(t->request[0]) != 0) && ((receive(ctx, t->request, &t->reply, t->sent) != RECEIVE_OK) || (t->reply.kind == REPLY_ERROR))) {
+			ctx->stats.fallbacks++;
+			ctx->stats.retries += sent - i;
+			ctx->pipeline_depth = 1;
+			drain(ctx);
+			sent = i;
+			continue;
+		}
+
+		i++;
+	}
+
+	return count;
+}
+
+// Values older than cache maxage milliseconds (if not negative) are read again
+int cached_processor(solar_ctx *ctx, int location) {
+	long long cached = ctx->processor_cached[location & 0xFF];
+	if ((cached != 0) && ((ctx->cache_maxage < 0) || (monotonic_ms() - cached <= ctx->cache_maxage))) {
+		return ctx->processor_cache[location & 0xFF];
+	}
+	return -1;
+}
+
+// Reads a register with op, reporting error codes
+static int read_register(solar_ctx *ctx, unsigned char op, int location) {
+	unsigned char frame[FRAME_SIZE];
+	pli_reply reply;
+	encode_request(frame, op, location, 0x00);
+
+	if (exchange(ctx, frame, &reply, 1) == -1) return -1;
+
+	if (reply.kind != REPLY_DATA) {
+		fail(ctx, SOLAR_EPLI, reply.code);
+		return -1;
+	}
+	return reply.value;
+}
+
+// Reads a processor register from the regulator, bypassing the cache
+static int fetch_processor(solar_ctx *ctx, int location) {
+	int value;
+	if ((value = read_register(ctx, OP_READ_PROCESSOR, location)) == -1) return -1;
+
+	ctx->processor_cache[location & 0xFF] = value;
+	ctx->processor_cached[location & 0xFF] = monotonic_ms();
+	return value;
+}
+
+int read_processor(solar_ctx *ctx, int location) {
+	int cached;
+	if ((cached = cached_processor(ctx, location)) != -1) return cached;
+
+	return fetch_processor(ctx, location);
+}
+
+int read_eprom(solar_ctx *ctx, int location) {
+	return read_register(ctx, OP_READ_EEPROM, location);
+}
+
+// Reads multiple registers with op (0x14 for processor, 0x48 for EEPROM) in one
+// pipelined exchange, values of registers which could not be read are -1
+// Error codes are not reported, so callers should read registers rejected with
+// them again; returns -1 if the link failed, which is reported, and then
+// registers are not worth reading again
+int read_registers(solar_ctx *ctx, unsigned char op, unsigned char *locations, int *values, int count) {
+	if (count == 0) return 0;
+
+	transaction *transactions = calloc(count, sizeof(transaction));
+	if (transactions == NULL) {
+		fail(ctx, SOLAR_ENOMEM, 0);
+		return -1;
+	}
+
+	int pending[count];
+	int i;
+	int p = 0;
+	for (i = 0; i < count; i++) {
+		if ((op == OP_READ_PROCESSOR) && ((values[i] = cached_processor(ctx, locations[i])) != -1)) {
+			pending[i] = -1;
+			continue;
+		}
+
+		encode_request(transactions[p].request, op, locations[i], 0x00);
+		pending[i] = p++;
+	}
+
+	int completed = transact(ctx, transactions, p);
+
+	for (i = 0; i < count; i++) {
+		if (pending[i] == -1) continue;
+
+		transaction *t = &transactions[pending[i]];
+		if ((pending[i] >= completed) || (t->reply.kind != REPLY_DATA)) {
+			values[i] = -1;
+			continue;
+		}
+
+		values[i] = t->reply.value;
+		if (op == OP_READ_PROCESSOR) {
+			ctx->processor_cache[locations[i]] = t->reply.value;
+			ctx->processor_cached[locations[i]] = monotonic_ms();
+		}
+	}
+
+	free(transactions);
+	return (completed < p) ? -1 : 0;
+}
+
+// Reads processor registers into the cache in one exchange, so that following
+// read_processor calls for them do not access the serial port
+// Returns -1 if the link failed
+int prefetch_processor(solar_ctx *ctx, unsigned char *locations, int count) {
+	int values[count];
+	return read_registers(ctx, OP_READ_PROCESSOR, locations, values, count);
+}
+
+// Sends a command which PLI does not reply to
+static int command(solar_ctx *ctx, unsigned char op, int location, unsigned char data) {
+	unsigned char frame[FRAME_SIZE];
+	encode_request(frame, op, location, data);
+
+	invalidate_cache(ctx);
+
+	if (write_frame(ctx, frame)) return -1;
+
+	return 0;
+}
+
+int write_processor(solar_ctx *ctx, int location, unsigned char data) {
+	return command(ctx, OP_WRITE_PROCESSOR, location, data);
+}
+
+int write_eprom(solar_ctx *ctx, int location, unsigned char data) {
+	return command(ctx, OP_WRITE_EEPROM, location, data);
+}
+
+// Pushes can reach the regulator even if their response does not arrive
+int long_push(solar_ctx *ctx) {
+	ctx->display_pushed = 1;
+	return command(ctx, OP_PUSH, PUSH_LONG, 0x00);
+}
+
+int short_push(solar_ctx *ctx) {
+	ctx->display_pushed = 1;
+	return command(ctx, OP_PUSH, PUSH_SHORT, 0x00);
+}
+
+static double decode_time(int values[]) {
+	// Hour register counts tenths of an hour and minute register minutes after that
+	return ((values[0] / 10) * 60 + ((values[0] % 10) * 6) + values[1]) * 60 + values[2];
+}
+
+static double decode_batcapacity(int values[]) {
+	return (values[0] <= 50) ? (values[0] * 20) : ((values[0] - 50) * 100);
+}
+
+static double decode_batvoltage(int values[]) {
+	return values[1] * (values[0] + 1);
+}
+
+static double decode_charge(int values[]) {
+	return values[0] / INTCHARGE_DIV + values[1] / (((values[2] & 0x01) == 0) ? 10.0 : 1.0);
+}
+
+static double decode_load(int values[]) {
+	return values[0] / INTLOAD_DIV + values[1] / (((values[2] & 0x02) == 0) ? 10.0 : 1.0);
+}
+
+static double decode_state(int values[]) {
+	return values[0] & 0x03;
+}
+
+// Wakes up the display and selects one, which stays until the end of the
+// session
+int select_display(solar_ctx *ctx, int display) {
+	int i;
+	if (ctx->display_awake == 0) {
+		// Repeats three times to be sure
+		for (i = 0; i < 3; i++) {
+			if (write_processor(ctx, 0x29, 0x00) == -1) return -1; // Wakes up the display
+		}
+		ctx->display_awake = 1;
+	}
+
+	if (ctx->display_selected != display) {
+		if (write_processor(ctx, 0x66, display) == -1) return -1;
+		ctx->display_selected = display;
+		ctx->display_selected_at = monotonic_ms();
+	}
+
+	return 0;
+}
+
+// Restores initial display and puts it to sleep if it was woken up
+// A display on which a button was pushed is left selected, as selecting
+// another one could interfere with what the push started, like power cycling
+int finish_session(solar_ctx *ctx) {
+	if (ctx->display_awake == 0) return 0;
+
+	if ((ctx->display_selected != 0x00) && (ctx->display_pushed == 0)) {
+		if (write_processor(ctx, 0x66, 0x00) == -1) return -1; // Selects initial display
+		ctx->display_selected = 0x00;
+	}
+
+	// Repeats three times to be sure
+	int i;
+	for (i = 0; i < 3; i++) {
+		if (write_processor(ctx, 0x29, 0x10) == -1) return -1; // Puts the display to sleep
+	}
+	ctx->display_awake = 0;
+	ctx->display_pushed = 0;
+
+	return 0;
+}
+
+static int read_solvoltage(solar_ctx *ctx, double *value) {
+	if (select_display(ctx, 0x27) == -1) return -1; // Selects solv display
+
+	// Measurement needs some time to stabilize after the display is selected,
+	// so it is read until consecutive readings settle or the maximum wait passes
+	int solv;
+	int previous = -1;
+	int settled = 0;
+	while (1) {
+		if ((solv = fetch_processor(ctx, 0x35)) == -1) return -1;
+
+		long long elapsed = monotonic_ms() - ctx->display_selected_at;
+		if ((previous != -1) && (abs(solv - previous) <= SOLVOLTAGE_TOLERANCE)) settled++;
+		else settled = 0;
+
+		if ((elapsed >= SOLVOLTAGE_MIN_WAIT) && (settled >= SOLVOLTAGE_SETTLED)) break;
+		if (elapsed >= SOLVOLTAGE_MAX_WAIT) break;
+
+		previous = solv;
+		sleep_ms(SOLVOLTAGE_POLL);
+	}
+
+	*value = (double)solv / 2.0;
+	return 0;
+}
+
+metric pli_metrics[] = {
+	{"plversion", "Version", NULL, METRIC_NUMBER, 0, 0x14, 1, {0x00}, NULL, 1.0},
+	{"day", "Day", NULL, METRIC_NUMBER, 0, 0x14, 1, {0x31}, NULL, 1.0},
+	{"time", "Time", NULL, METRIC_TIME, 0, 0x14, 3, {0x30, 0x2F, 0x2E}, decode_time, 1.0},
+	{"batcapacity", "Battery capacity", "Ah", METRIC_NUMBER, 0, 0x14, 1, {0x5E}, decode_batcapacity, 1.0},
+	{"batvoltage", "Battery voltage", "V", METRIC_NUMBER, 1, 0x14, 2, {0x20, 0x32}, decode_batvoltage, 0.1},
+	{"solvoltage", "Solar voltage", "V", METRIC_NUMBER, 1, 0x00, 0, {0}, NULL, 1.0, NULL, read_solvoltage},
+	{"charge", "Charging current", "A", METRIC_NUMBER, 1, 0x14, 3, {0xD5, 0xCD, 0xCF}, decode_charge, 1.0},
+	{"load", "Load current", "A", METRIC_NUMBER, 1, 0x14, 3, {0xD9, 0xCE, 0xCF}, decode_load, 1.0},
+	{"state", "Regulator state", NULL, METRIC_ENUM, 0, 0x14, 1, {0x65}, decode_state, 1.0, pli_states},
+	{NULL}
+};
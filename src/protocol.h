@@ -0,0 +1,90 @@
+#ifndef PROTOCOL_H_
+#define PROTOCOL_H_
+
+#include "solar.h"
+#include "serial.h"
+#include "metric.h"
+#include "frame.h"
+
+#define PIPELINE_MAX 16
+#define DRAIN_WAIT 200
+#define RECOVERY_RETRY 3
+#define RECOVERY_BACKOFF 50 // Milliseconds before the first recovery, doubled for every next one
+#define RECOVERY_BACKOFF_MAX 800
+#define RECEIVE_OK 0
+#define RECEIVE_TIMEOUT 1 // Nothing arrived
+#define RECEIVE_DESYNC 2 // Unexpected or incomplete data arrived
+#define RECEIVE_FAILED 3 // Reading failed
+#define SOLVOLTAGE_POLL 250 // Interval between solar voltage readings while it stabilizes
+#define SOLVOLTAGE_MIN_WAIT 500
+#define SOLVOLTAGE_MAX_WAIT 3000
+#define SOLVOLTAGE_TOLERANCE 1 // In register units of 0.5 V
+#define SOLVOLTAGE_SETTLED 2 // Number of consecutive readings within tolerance of the previous one
+#define INTLOAD_DIV 10.0 // PL20/PL40 = 10.0, PL60 = 5.0
+#define INTCHARGE_DIV 10.0  // PL20 = 10.0, PL40 = 5.0, PL60 = 2.5
+#define DEFAULT_SOLAR_TIMEOUT 2000
+#define DEFAULT_SOLAR_PIPELINE 1
+#define DEFAULT_SOLAR_MAXAGE 0 // Library users poll, so every call reads values again
+
+// State of a connection to a PLI
+struct solar_ctx {
+	int fd;
+	int reply_timeout; // Milliseconds
+	int pipeline_depth; // Falls back to 1 if PLI does not keep up
+	int cache_maxage; // Milliseconds, negative for the whole session
+
+	// Values of processor registers already read in this session, so that
+	// commands which depend on the same register (like 0xCF) read it only once
+	int processor_cache[256];
+	long long processor_cached[256];
+
+	long long last_command; // When the last command was sent, for latency of its response
+
+	// Solar voltage is measured only while it is shown on the display, which
+	// is woken up and selected only when needed and stays so until the end of
+	// the session
+	int display_awake;
+	int display_selected;
+	long long display_selected_at;
+	int display_pushed; // A button was pushed on the selected display
+
+	int error; // Of the last failure, SOLAR_*
+	int errnum; // errno of the last failure
+	int code; // Error code of the last SOLAR_EPLI failure
+	void (*report)(solar_ctx *ctx); // Called on failures if not NULL
+
+	serial_counters stats;
+};
+
+typedef struct {
+	unsigned char request[FRAME_SIZE];
+	pli_reply reply; // Only for requests with a reply
+	long long sent; // Monotonic time when the command was sent
+} transaction;
+
+extern char *pli_states[];
+extern metric pli_metrics[];
+
+solar_ctx *new_session();
+int open_session(solar_ctx *ctx, char *device, speed_t baud, int timeout);
+void fail(solar_ctx *ctx, int error, int code);
+void invalidate_cache(solar_ctx *ctx);
+int write_frames(solar_ctx *ctx, unsigned char *frames[], int count);
+int write_frame(solar_ctx *ctx, unsigned char frame[]);
+void drain(solar_ctx *ctx);
+int loopback(solar_ctx *ctx);
+int exchange(solar_ctx *ctx, unsigned char request[], pli_reply *reply, int report_errors);
+int transact(solar_ctx *ctx, transaction transactions[], int count);
+int cached_processor(solar_ctx *ctx, int location);
+int read_processor(solar_ctx *ctx, int location);
+int read_eprom(solar_ctx *ctx, int location);
+int read_registers(solar_ctx *ctx, unsigned char op, unsigned char locations[], int values[], int count);
+int prefetch_processor(solar_ctx *ctx, unsigned char locations[], int count);
+int write_processor(solar_ctx *ctx, int location, unsigned char data);
+int write_eprom(solar_ctx *ctx, int location, unsigned char data);
+int long_push(solar_ctx *ctx);
+int short_push(solar_ctx *ctx);
+int select_display(solar_ctx *ctx, int display);
+int finish_session(solar_ctx *ctx);
+
+#endif /* PROTOCOL_H_ */
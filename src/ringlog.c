@@ -0,0 +1,163 @@
+#include <string.h>
+#include <stdio.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "ringlog.h"
+#include "main.h"
+
+static size_t ringlog_size(unsigned int capacity) {
+	return sizeof(ringlog_header) + (size_t)capacity * sizeof(ringlog_record);
+}
+
+// Opens a log file, a writable log file is created and preallocated if it does
+// not exist yet or is empty, with space for log_records records of registers
+// An existing log file keeps its capacity and registers, and other files are
+// never overwritten
+ringlog *open_ringlog(int writable) {
+	int file;
+	if ((file = open(log_file, (writable != 0) ? (O_RDWR | O_CREAT) : O_RDONLY, 0644)) == -1) {
+		fprintf(stderr, "Could not open log file '%s': %s.\n", log_file, strerror(errno));
+		return NULL;
+	}
+
+	ringlog_header header;
+	int r = read(file, &header, sizeof(header));
+	if (r == -1) {
+		fprintf(stderr, "Could not read log file '%s': %s.\n", log_file, strerror(errno));
+		close(file);
+		return NULL;
+	}
+
+	struct stat info;
+	if (fstat(file, &info) == -1) {
+		fprintf(stderr, "Could not read log file '%s': %s.\n", log_file, strerror(errno));
+		close(file);
+		return NULL;
+	}
+
+	// Records are indexed modulo capacity, so it cannot be 0 and indexes have
+	// to be within the file
+	int valid = (r == sizeof(header)) && (header.magic == RINGLOG_MAGIC) && (header.registers_count <= RINGLOG_REGISTERS);
+	valid = valid && (header.capacity > 0) && (header.next < header.capacity) && (header.count <= header.capacity) && (info.st_size >= ringlog_size(header.capacity));
+	int empty = (info.st_size == 0);
+
+	if ((valid == 0) && ((writable == 0) || (empty == 0))) {
+		fprintf(stderr, "Invalid log file '%s'.\n", log_file);
+		close(file);
+		return NULL;
+	}
+
+	if ((valid != 0) && (writable != 0) && (log_layout_given != 0) && ((header.capacity != log_records) || (header.registers_count != registers_count) || (memcmp(header.registers, registers, registers_count) != 0))) {
+		fprintf(stderr, "Log file '%s' has space for %u records of %d registers, which -n and -r cannot change.\n", log_file, header.capacity, header.registers_count);
+		close(file);
+		return NULL;
+	}
+
+	if (valid == 0) {
+		memset(&header, 0, sizeof(header));
+		header.magic = RINGLOG_MAGIC;
+		header.capacity = log_records;
+		header.registers_count = registers_count;
+		memcpy(header.registers, registers, registers_count);
+
+		// We allocate the whole file in advance so that logging never grows it
+		if ((ftruncate(file, 0) == -1) || ((errno = posix_fallocate(file, 0, ringlog_size(header.capacity))) != 0)) {
+			if ((errno != EOPNOTSUPP) && (errno != EINVAL)) {
+				fprintf(stderr, "Could not allocate log file '%s': %s.\n", log_file, strerror(errno));
+				close(file);
+				return NULL;
+			}
+			// File system does not support allocation so we just set the size
+			if (ftruncate(file, ringlog_size(header.capacity)) == -1) {
+				fprintf(stderr, "Could not allocate log file '%s': %s.\n", log_file, strerror(errno));
+				close(file);
+				return NULL;
+			}
+		}
+	}
+
+	ringlog *log = mmap(NULL, ringlog_size(header.capacity), (writable != 0) ? (PROT_READ | PROT_WRITE) : PROT_READ, MAP_SHARED, file, 0);
+
+	// Mapping stays valid after the file is closed
+	close(file);
+
+	if (log == MAP_FAILED) {
+		fprintf(stderr, "Could not map log file '%s': %s.\n", log_file, strerror(errno));
+		return NULL;
+	}
+
+	if (valid == 0) log->header = header;
+
+	return log;
+}
+
+void close_ringlog(ringlog *log) {
+	size_t size = ringlog_size(log->header.capacity);
+	msync(log, size, MS_SYNC);
+	munmap(log, size);
+}
+
+// Writes the record over the oldest one when the log is full
+void append_ringlog(ringlog *log, ringlog_record *record) {
+	log->records[log->header.next] = *record;
+
+	// Header is updated only after the record is complete
+	__sync_synchronize();
+
+	log->header.next = (log->header.next + 1) % log->header.capacity;
+	if (log->header.count < log->header.capacity) log->header.count++;
+}
+
+// Outputs records in the log file from the oldest to the newest
+int dump_log(solar_ctx *ctx) {
+	ringlog *log;
+	if ((log = open_ringlog(0)) == NULL) return 2;
+
+	ringlog_header *header = &log->header;
+	int i;
+	int j;
+
+	if (output_format == FORMAT_CSV) {
+		fprintf(out, "time");
+		for (j = 0; j < header->registers_count; j++) {
+			fprintf(out, ",0x%02X", header->registers[j]);
+		}
+		fprintf(out, "\n");
+	}
+
+	unsigned int first = (header->next + header->capacity - header->count) % header->capacity;
+	for (i = 0; i < header->count; i++) {
+		ringlog_record *record = &log->records[(first + i) % header->capacity];
+
+		if (output_format == FORMAT_CSV) {
+			fprintf(out, "%u.%03u", record->seconds, record->milliseconds);
+			for (j = 0; j < header->registers_count; j++) {
+				if ((record->missing & (1 << j)) != 0) fprintf(out, ",");
+				else fprintf(out, ",%d", record->values[j]);
+			}
+		}
+		else {
+			time_t seconds = record->seconds;
+			char timestamp[32];
+			strftime(timestamp, sizeof(timestamp), "%Y-%m-%d %H:%M:%S", localtime(&seconds));
+			fprintf(out, "%s.%03u", timestamp, record->milliseconds);
+			for (j = 0; j < header->registers_count; j++) {
+				if (plain_output == 0) fprintf(out, " 0x%02X=", header->registers[j]);
+				else fprintf(out, " ");
+
+				if ((record->missing & (1 << j)) != 0) fprintf(out, "-");
+				else fprintf(out, "%d", record->values[j]);
+			}
+		}
+		fprintf(out, "\n");
+	}
+
+	munmap(log, ringlog_size(header->capacity));
+
+	return 0;
+}
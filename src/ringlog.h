@@ -0,0 +1,38 @@
+#ifndef RINGLOG_H_
+#define RINGLOG_H_
+
+#include "solar.h"
+
+#define DEFAULT_LOG_FILE "solar.log"
+#define DEFAULT_LOG_RECORDS 4096
+#define RINGLOG_MAGIC 0x534F4C4C
+#define RINGLOG_REGISTERS 16
+
+typedef struct {
+	unsigned int magic;
+	unsigned int capacity; // Number of records the file has space for
+	unsigned int next; // Index of the record which will be written next
+	unsigned int count; // Number of records written so far, at most capacity
+	unsigned char registers_count;
+	unsigned char registers[RINGLOG_REGISTERS];
+	unsigned char reserved[RINGLOG_REGISTERS - 1];
+} ringlog_header;
+
+typedef struct {
+	unsigned int seconds; // Since the epoch
+	unsigned short milliseconds;
+	unsigned short missing; // Bit is set for every register which could not be read
+	unsigned char values[RINGLOG_REGISTERS];
+} ringlog_record;
+
+typedef struct {
+	ringlog_header header;
+	ringlog_record records[];
+} ringlog;
+
+ringlog *open_ringlog(int writable);
+void close_ringlog(ringlog *log);
+void append_ringlog(ringlog *log, ringlog_record *record);
+int dump_log(solar_ctx *ctx);
+
+#endif /* RINGLOG_H_ */
@@ -0,0 +1,139 @@
+#include <stdint.h>
+#include <string.h>
+#include <stdio.h>
+#include <errno.h>
+#include <unistd.h>
+#include <math.h>
+#include <sys/timerfd.h>
+
+#include "scheduler.h"
+#include "main.h"
+#include "pli.h"
+#include "protocol.h"
+#include "serial.h"
+#include "snapshot.h"
+
+// Reads every metric of the snapshot at its own pace instead of all of them
+// every interval: the process sleeps on a timer armed for the next metric
+// which is due, so there are no wakeups while nothing is
+
+// Metrics whose values rarely change are read rarely, until they do
+schedule_entry schedule_table[] = {
+	{"charge", 1000, 30000, 0},
+	{"load", 1000, 30000, 0},
+	{"batvoltage", 5000, 60000, 1},
+	{"state", 10000, 600000, 2},
+	{"solvoltage", 10000, 300000, 3}, // Read through the display, which is slow
+	{"time", 60000, 60000, 4},
+	{"day", 60000, 3600000, 5},
+	{"batcapacity", 3600000, 86400000, 6},
+	{"plversion", 3600000, 86400000, 6},
+	{NULL}
+};
+
+// Picks metrics due within SCHEDULE_SLACK, by priority and then by how long
+// they are overdue, so that slow metrics never delay fast ones for long
+static int select_due(scheduled_metric *metrics, int count, long long now, scheduled_metric *due[]) {
+	int n = 0;
+	while (n < SCHEDULE_BATCH) {
+		scheduled_metric *best = NULL;
+		int i;
+		int j;
+		for (i = 0; i < count; i++) {
+			scheduled_metric *s = &metrics[i];
+			if (s->due > now + SCHEDULE_SLACK) continue;
+			for (j = 0; (j < n) && (due[j] != s); j++);
+			if (j < n) continue;
+			if ((best == NULL) || (s->entry->priority < best->entry->priority) || ((s->entry->priority == best->entry->priority) && (s->due < best->due))) best = s;
+		}
+		if (best == NULL) break;
+		due[n++] = best;
+	}
+	return n;
+}
+
+int pli_schedule(solar_ctx *ctx) {
+	snapshot *shared;
+	if ((shared = open_snapshot(1)) == NULL) return 2;
+
+	int timer;
+	if ((timer = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC)) == -1) {
+		fprintf(stderr, "Could not create timer: %s.\n", strerror(errno));
+		return 2;
+	}
+
+	scheduled_metric metrics[SNAPSHOT_VALUES];
+	int count = 0;
+	long long now = monotonic_ms();
+	schedule_entry *e;
+	for (e = schedule_table; (e->name != NULL) && (count < SNAPSHOT_VALUES); e++) {
+		scheduled_metric *s = &metrics[count++];
+		s->entry = e;
+		s->m = find_metric(pli_metrics, e->name);
+		s->index = find_snapshot(e->name);
+		s->due = now;
+		s->current = e->interval;
+		s->value = NAN;
+	}
+
+	while (1) {
+		long long next = metrics[0].due;
+		int i;
+		for (i = 1; i < count; i++) {
+			if (metrics[i].due < next) next = metrics[i].due;
+		}
+
+		// Timer in the past expires at once
+		struct itimerspec timeout = {{0, 0}, {next / 1000, (next % 1000) * 1000000}};
+		if (timerfd_settime(timer, TFD_TIMER_ABSTIME, &timeout, NULL) == -1) {
+			fprintf(stderr, "Could not set timer: %s.\n", strerror(errno));
+			close(timer);
+			return 2;
+		}
+
+		uint64_t expirations;
+		if (read(timer, &expirations, sizeof(expirations)) == -1) {
+			if (errno == EINTR) continue;
+			fprintf(stderr, "Could not wait for timer: %s.\n", strerror(errno));
+			close(timer);
+			return 2;
+		}
+
+		scheduled_metric *due[SCHEDULE_BATCH];
+		int n = select_due(metrics, count, monotonic_ms(), due);
+		if (n == 0) continue;
+
+		// Every read gets fresh values
+		invalidate_cache(ctx);
+
+		metric *read[SCHEDULE_BATCH];
+		double values[SCHEDULE_BATCH];
+		for (i = 0; i < n; i++) {
+			read[i] = due[i]->m;
+		}
+		read_metrics(ctx, read, n, values);
+
+		// Display is not kept awake between reads
+		pli_finish(ctx);
+
+		now = monotonic_ms();
+		for (i = 0; i < n; i++) {
+			scheduled_metric *s = due[i];
+			if (isnan(values[i])) {
+				s->current = s->entry->interval;
+			}
+			else {
+				write_snapshot(shared, s->index, values[i]);
+
+				// Backs off while unchanged, goes back to its interval when it moves
+				if (values[i] == s->value) s->current = (s->current * 2 > s->entry->max_interval) ? s->entry->max_interval : s->current * 2;
+				else s->current = s->entry->interval;
+				s->value = values[i];
+			}
+			s->due = now + s->current;
+		}
+	}
+
+	close(timer);
+	return 0;
+}
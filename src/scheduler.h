@@ -0,0 +1,33 @@
+#ifndef SCHEDULER_H_
+#define SCHEDULER_H_
+
+#include "solar.h"
+#include "metric.h"
+
+#define SCHEDULE_SLACK 200 // Metrics due within this many milliseconds are read together
+#define SCHEDULE_BATCH 4 // Metrics read at most at one wakeup, by priority
+
+// How often a metric in the snapshot is read: every interval milliseconds
+// while its value changes, backing off up to max_interval while it does not
+typedef struct {
+	char *name;
+	int interval;
+	int max_interval;
+	int priority; // Lower is read first when more metrics are due
+} schedule_entry;
+
+// State of a scheduled metric
+typedef struct {
+	schedule_entry *entry;
+	metric *m;
+	int index; // In the snapshot
+	long long due; // Monotonic milliseconds
+	long long current; // Until the next read, between interval and max_interval
+	double value; // Last value read, NAN if none
+} scheduled_metric;
+
+extern schedule_entry schedule_table[];
+
+int pli_schedule(solar_ctx *ctx);
+
+#endif /* SCHEDULER_H_ */
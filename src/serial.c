@@ -0,0 +1,223 @@
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <poll.h>
+#include <termios.h>
+#include <sys/file.h>
+#include <sys/ioctl.h>
+#include <sys/uio.h>
+
+#include "serial.h"
+
+// All I/O is non-blocking and bounded by deadlines in milliseconds of the
+// monotonic clock, errors are returned with errno set (ETIMEDOUT on timeout)
+
+// Upper bounds of latency histogram buckets in milliseconds, the last one
+// counts everything above
+long long latency_bounds[LATENCY_BUCKETS - 1] = {1, 2, 5, 10, 20, 50, 100, 200, 500, 1000, 2000};
+
+long long monotonic_ms() {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (long long)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+// Milliseconds since the epoch, for timestamps
+long long realtime_ms() {
+	struct timespec now;
+	clock_gettime(CLOCK_REALTIME, &now);
+	return (long long)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+void sleep_ms(long long ms) {
+	if (ms <= 0) return;
+
+	struct timespec duration = {ms / 1000, (ms % 1000) * 1000000};
+	while ((nanosleep(&duration, &duration) == -1) && (errno == EINTR));
+}
+
+// Waits for events on fd until deadline, returns 0 when they happen
+static int wait_until(int fd, short events, long long deadline) {
+	while (1) {
+		long long remaining = deadline - monotonic_ms();
+		if (remaining < 0) remaining = 0;
+
+		struct pollfd pfd = {fd, events, 0};
+		int ready = poll(&pfd, 1, remaining);
+		if (ready > 0) return 0;
+		if (ready == 0) {
+			errno = ETIMEDOUT;
+			return -1;
+		}
+		if (errno != EINTR) return -1;
+	}
+}
+
+// Closes fd after a failure, preserving errno of the failure
+static int closefailed(int fd) {
+	int e = errno;
+	close(fd);
+	errno = e;
+	return -1;
+}
+
+void count_error(serial_counters *stats, unsigned char code) {
+	if ((code >= 0x81) && (code <= 0x86)) stats->errors[code - 0x81]++;
+	else stats->errors[ERROR_CODES - 1]++;
+}
+
+void count_latency(serial_counters *stats, long long ms) {
+	int i;
+	for (i = 0; (i < LATENCY_BUCKETS - 1) && (ms > latency_bounds[i]); i++);
+	stats->latency[i]++;
+	stats->latency_sum += ms;
+	if (ms > stats->latency_max) stats->latency_max = ms;
+}
+
+// Returns speed constant for a baud rate, B0 if it is not supported
+speed_t serialspeed(int baud) {
+	switch (baud) {
+		case 50:
+			return B50;
+		case 75:
+			return B75;
+		case 110:
+			return B110;
+		case 134:
+			return B134;
+		case 150:
+			return B150;
+		case 200:
+			return B200;
+		case 300:
+			return B300;
+		case 600:
+			return B600;
+		case 1200:
+			return B1200;
+		case 1800:
+			return B1800;
+		case 2400:
+			return B2400;
+		case 4800:
+			return B4800;
+		case 9600:
+			return B9600;
+		case 19200:
+			return B19200;
+		case 38400:
+			return B38400;
+		case 57600:
+			return B57600;
+		case 115200:
+			return B115200;
+		case 230400:
+			return B230400;
+		default:
+			return B0;
+	}
+}
+
+// Opens and locks serial port device file, waiting for the lock at most timeout
+// milliseconds, which is counted in stats
+int openserialport(char *device, speed_t baud, int timeout, serial_counters *stats) {
+	int fd;
+	struct termios params;
+
+	// We use O_NONBLOCK because otherwise open blocks if serial port is not yet
+	// connected, and we keep it so that no I/O can block past its deadline
+	if ((fd = open(device, O_RDWR | O_NOCTTY | O_NONBLOCK)) == -1) return -1;
+	if (tcgetattr(fd, &params) == -1) return closefailed(fd);
+
+	cfmakeraw(&params);
+
+	// 8 bit data, one stop bit, RTS/CTS flow control; speed is kept in the
+	// same flags on some systems, so it is set after them
+	params.c_cflag = CLOCAL | CREAD | CS8 | HUPCL | CRTSCTS;
+	cfsetspeed(&params, baud);
+
+	if (tcsetattr(fd, TCSANOW, &params) == -1) return closefailed(fd);
+
+	// Other processes can hold the lock, so we retry until timeout
+	long long start = monotonic_ms();
+	long long deadline = start + timeout;
+	while (flock(fd, LOCK_EX | LOCK_NB) == -1) {
+		if ((errno != EWOULDBLOCK) && (errno != EINTR)) return closefailed(fd);
+		if (monotonic_ms() >= deadline) {
+			stats->lock_wait += monotonic_ms() - start;
+			errno = ETIMEDOUT;
+			return closefailed(fd);
+		}
+		sleep_ms(LOCK_RETRY_WAIT);
+	}
+
+	stats->locked_at = monotonic_ms();
+	stats->lock_wait += stats->locked_at - start;
+
+	// Drops anything left from previous sessions, like responses to commands
+	// which timed out
+	tcflush(fd, TCIOFLUSH);
+
+	return fd;
+}
+
+// Reads at most size bytes, returns number of bytes read
+int read_until(int fd, unsigned char *buffer, int size, long long deadline) {
+	while (1) {
+		if (wait_until(fd, POLLIN, deadline) == -1) return -1;
+
+		int count = read(fd, buffer, size);
+		if (count > 0) return count;
+		if (count == 0) {
+			// End of file, device was probably disconnected
+			errno = EIO;
+			return -1;
+		}
+		if ((errno != EAGAIN) && (errno != EINTR)) return -1;
+	}
+}
+
+// Writes all bytes of count buffers, as many of them at once as the device
+// takes, and waits for them to be transmitted; iov is modified while writing
+int writev_until(int fd, struct iovec *iov, int count, long long deadline) {
+	while (count > 0) {
+		if (wait_until(fd, POLLOUT, deadline) == -1) return -1;
+
+		ssize_t written = writev(fd, iov, count);
+		if (written == -1) {
+			if ((errno != EAGAIN) && (errno != EINTR)) return -1;
+			continue;
+		}
+
+		// Skips buffers which were written whole
+		while ((count > 0) && (written >= iov->iov_len)) {
+			written -= iov->iov_len;
+			iov++;
+			count--;
+		}
+		if (count > 0) {
+			iov->iov_base = (unsigned char *)iov->iov_base + written;
+			iov->iov_len -= written;
+		}
+	}
+
+	// tcdrain could block without a bound (with flow control), so we poll instead
+	int pending;
+	while ((ioctl(fd, TIOCOUTQ, &pending) == 0) && (pending > 0)) {
+		if (monotonic_ms() >= deadline) {
+			errno = ETIMEDOUT;
+			return -1;
+		}
+		sleep_ms(1);
+	}
+
+	return 0;
+}
+
+// Writes all size bytes and waits for them to be transmitted
+int write_until(int fd, unsigned char *buffer, int size, long long deadline) {
+	struct iovec iov = {buffer, size};
+	return writev_until(fd, &iov, 1, deadline);
+}
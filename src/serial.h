@@ -0,0 +1,44 @@
+#ifndef SERIAL_H_
+#define SERIAL_H_
+
+#include <termios.h>
+#include <sys/uio.h>
+
+#define LOCK_RETRY_WAIT 50
+
+#define LATENCY_BUCKETS 12
+#define ERROR_CODES 7 // 0x81 to 0x86 and any other
+
+// Serial port and PLI transport usage of this process
+typedef struct {
+	long long written; // Bytes
+	long long read; // Bytes
+	long long lock_wait; // Milliseconds spent waiting for the lock
+	long long locked_at; // Monotonic time when the lock was acquired
+	long long lock_held; // Milliseconds the lock was held, set when the session ends
+	long long echoes; // Commands echoed by PLI before their response
+	long long partial_reads; // Reads which returned only a part of a response
+	long long timeouts; // Responses which did not arrive in time
+	long long retries; // Commands sent again
+	long long fallbacks; // Pipelined exchanges which fell back to one command at a time
+	long long recoveries; // Attempts to get back in sync with PLI
+	long long errors[ERROR_CODES]; // Error codes in responses, by code - 0x81
+	long long latency[LATENCY_BUCKETS]; // Transactions by milliseconds from command to response
+	long long latency_sum;
+	long long latency_max;
+} serial_counters;
+
+extern long long latency_bounds[];
+
+long long monotonic_ms();
+long long realtime_ms();
+void sleep_ms(long long ms);
+void count_error(serial_counters *stats, unsigned char code);
+void count_latency(serial_counters *stats, long long ms);
+speed_t serialspeed(int baud);
+int openserialport(char *device, speed_t baud, int timeout, serial_counters *stats);
+int read_until(int fd, unsigned char *buffer, int size, long long deadline);
+int writev_until(int fd, struct iovec *iov, int count, long long deadline);
+int write_until(int fd, unsigned char *buffer, int size, long long deadline);
+
+#endif /* SERIAL_H_ */
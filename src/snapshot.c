@@ -0,0 +1,172 @@
+#include <string.h>
+#include <stdio.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <math.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/file.h>
+
+#include "snapshot.h"
+#include "main.h"
+#include "metric.h"
+#include "serial.h"
+
+// Names of metrics whose values are available in the snapshot, by index
+char *snapshot_names[] = {"batvoltage", "solvoltage", "charge", "load", "state", "time", "day", "batcapacity", "plversion", NULL};
+
+// Commands which can read their values from the snapshot
+char *snapshot_commands[] = {"batvoltage", "solvoltage", "charge", "load", "state", "gettime", "getday", "batcapacity", "plversion", "get", NULL};
+
+static snapshot *reader = NULL;
+
+snapshot *open_snapshot(int writable) {
+	int file;
+
+	// Path is predictable in a directory anyone can write to, so the sampler
+	// must not follow a link planted there and resize and clear another file,
+	// and readers must not block on a planted FIFO
+	if ((file = open(SNAPSHOT_FILE, ((writable != 0) ? (O_RDWR | O_CREAT) : O_RDONLY) | O_NOFOLLOW | O_NONBLOCK, 0644)) == -1) {
+		fprintf(stderr, "Could not open shared memory snapshot '%s': %s.\n", SNAPSHOT_FILE, strerror(errno));
+		return NULL;
+	}
+
+	struct stat info;
+	if (fstat(file, &info) == -1) {
+		fprintf(stderr, "Could not open shared memory snapshot '%s': %s.\n", SNAPSHOT_FILE, strerror(errno));
+		close(file);
+		return NULL;
+	}
+
+	if (!S_ISREG(info.st_mode) || ((writable != 0) && ((info.st_uid != geteuid()) || (info.st_nlink != 1)))) {
+		fprintf(stderr, "Shared memory snapshot '%s' is not a regular file owned by this user.\n", SNAPSHOT_FILE);
+		close(file);
+		return NULL;
+	}
+
+	// Lock is held until the sampler exits, so the file is not closed then
+	if ((writable != 0) && (flock(file, LOCK_EX | LOCK_NB) == -1)) {
+		if (errno == EWOULDBLOCK) fprintf(stderr, "Shared memory snapshot '%s' is written by another process.\n", SNAPSHOT_FILE);
+		else fprintf(stderr, "Could not lock shared memory snapshot '%s': %s.\n", SNAPSHOT_FILE, strerror(errno));
+		close(file);
+		return NULL;
+	}
+
+	if (info.st_size != sizeof(snapshot)) {
+		if (writable == 0) {
+			fprintf(stderr, "Invalid shared memory snapshot '%s'.\n", SNAPSHOT_FILE);
+			close(file);
+			return NULL;
+		}
+		if (ftruncate(file, sizeof(snapshot)) == -1) {
+			fprintf(stderr, "Could not resize shared memory snapshot '%s': %s.\n", SNAPSHOT_FILE, strerror(errno));
+			close(file);
+			return NULL;
+		}
+	}
+
+	snapshot *shared = mmap(NULL, sizeof(snapshot), (writable != 0) ? (PROT_READ | PROT_WRITE) : PROT_READ, MAP_SHARED, file, 0);
+
+	// Mapping stays valid after the file is closed
+	if ((writable == 0) || (shared == MAP_FAILED)) close(file);
+
+	if (shared == MAP_FAILED) {
+		fprintf(stderr, "Could not map shared memory snapshot '%s': %s.\n", SNAPSHOT_FILE, strerror(errno));
+		return NULL;
+	}
+
+	if ((shared->magic != SNAPSHOT_MAGIC) || (shared->size != sizeof(snapshot))) {
+		if (writable == 0) {
+			fprintf(stderr, "Invalid shared memory snapshot '%s'.\n", SNAPSHOT_FILE);
+			munmap(shared, sizeof(snapshot));
+			return NULL;
+		}
+		memset(shared, 0, sizeof(snapshot));
+		shared->size = sizeof(snapshot);
+		__sync_synchronize();
+		shared->magic = SNAPSHOT_MAGIC;
+	}
+
+	// A previous sampler could have died while updating values
+	if ((writable != 0) && ((shared->sequence & 1) != 0)) {
+		shared->sequence++;
+		__sync_synchronize();
+	}
+
+	return shared;
+}
+
+int find_snapshot(char *name) {
+	int i;
+	for (i = 0; snapshot_names[i] != NULL; i++) {
+		if (strcmp(snapshot_names[i], name) == 0) return i;
+	}
+	return -1;
+}
+
+void write_snapshot(snapshot *shared, int index, double value) {
+	shared->sequence++;
+	__sync_synchronize();
+
+	shared->values[index].value = value;
+	shared->values[index].timestamp = realtime_ms();
+
+	__sync_synchronize();
+	shared->sequence++;
+}
+
+// Reads a value from the snapshot, which has to be at most cache_maxage
+// milliseconds old (if not negative)
+int read_snapshot(int index, double *value) {
+	if ((reader == NULL) && ((reader = open_snapshot(0)) == NULL)) return -1;
+
+	snapshot_value current;
+	unsigned int sequence;
+	int retries = 0;
+	while (1) {
+		if (((sequence = reader->sequence) & 1) == 0) {
+			__sync_synchronize();
+			current = reader->values[index];
+			__sync_synchronize();
+			if (reader->sequence == sequence) break;
+		}
+
+		if (++retries == SNAPSHOT_RETRIES) {
+			fprintf(stderr, "Values in shared memory snapshot '%s' are being updated for too long.\n", SNAPSHOT_FILE);
+			return -1;
+		}
+		sched_yield();
+	}
+
+	if (current.timestamp == 0) {
+		fprintf(stderr, "No '%s' value in shared memory snapshot yet.\n", snapshot_names[index]);
+		return -1;
+	}
+	if ((cache_maxage >= 0) && (realtime_ms() - current.timestamp > cache_maxage)) {
+		fprintf(stderr, "Value '%s' in shared memory snapshot is too old.\n", snapshot_names[index]);
+		return -1;
+	}
+
+	*value = current.value;
+	return 0;
+}
+
+// Reads values of metrics from the snapshot, NAN if they are not available
+int read_snapshot_metrics(metric *metrics[], int count, double values[]) {
+	int ret = 0;
+	int i;
+	for (i = 0; i < count; i++) {
+		int index = find_snapshot(metrics[i]->name);
+		if (index == -1) {
+			fprintf(stderr, "Metric '%s' is not available from shared memory snapshot.\n", metrics[i]->name);
+		}
+		if ((index == -1) || (read_snapshot(index, &values[i]) == -1)) {
+			values[i] = NAN;
+			ret = -1;
+		}
+	}
+	return ret;
+}
@@ -0,0 +1,46 @@
+#ifndef SNAPSHOT_H_
+#define SNAPSHOT_H_
+
+#include "metric.h"
+
+#define SNAPSHOT_FILE "/dev/shm/solar"
+#define SNAPSHOT_MAGIC 0x534F4C52
+#define SNAPSHOT_RETRIES 100000 // Of readers while values are being updated, a sampler which died while updating them leaves the sequence odd
+
+#define SNAPSHOT_BATVOLTAGE 0
+#define SNAPSHOT_SOLVOLTAGE 1
+#define SNAPSHOT_CHARGE 2
+#define SNAPSHOT_LOAD 3
+#define SNAPSHOT_STATE 4
+#define SNAPSHOT_TIME 5
+#define SNAPSHOT_SAMPLED 6 // Values before it are read by the sample command
+#define SNAPSHOT_DAY 6
+#define SNAPSHOT_BATCAPACITY 7
+#define SNAPSHOT_PLVERSION 8
+#define SNAPSHOT_VALUES 9
+
+typedef struct {
+	double value;
+	long long timestamp; // In milliseconds since the epoch, 0 if there is no value yet
+} snapshot_value;
+
+// Values are protected by a sequence lock: sequence is odd while the sampler
+// is updating values and readers retry if it changed while they were reading;
+// there is only one sampler, which holds an exclusive lock on the file
+typedef struct {
+	unsigned int magic;
+	unsigned int size;
+	volatile unsigned int sequence;
+	snapshot_value values[SNAPSHOT_VALUES];
+} snapshot;
+
+extern char *snapshot_names[];
+extern char *snapshot_commands[];
+
+snapshot *open_snapshot(int writable);
+int find_snapshot(char *name);
+void write_snapshot(snapshot *shared, int index, double value);
+int read_snapshot(int index, double *value);
+int read_snapshot_metrics(metric *metrics[], int count, double values[]);
+
+#endif /* SNAPSHOT_H_ */
@@ -0,0 +1,195 @@
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+
+#include "solar.h"
+#include "protocol.h"
+#include "serial.h"
+#include "metric.h"
+
+// Library interface: a context for every connection, values returned in
+// structs and failures as SOLAR_* error codes
+
+static const char *error_messages[SOLAR_ERRORS] = {
+	"Success",
+	"Invalid argument",
+	"Could not allocate memory",
+	"Could not open serial port",
+	"Timeout while waiting for serial port",
+	"Could not write command",
+	"Could not read response",
+	"Timeout while waiting for response",
+	"Invalid response",
+	"Command failed",
+	"Could not close serial port"
+};
+
+// Creates a context without a serial port, with default parameters
+solar_ctx *new_session() {
+	solar_ctx *ctx = calloc(1, sizeof(solar_ctx));
+	if (ctx == NULL) return NULL;
+
+	ctx->fd = -1;
+	ctx->reply_timeout = DEFAULT_SOLAR_TIMEOUT;
+	ctx->pipeline_depth = DEFAULT_SOLAR_PIPELINE;
+	ctx->cache_maxage = DEFAULT_SOLAR_MAXAGE;
+	return ctx;
+}
+
+// Opens and locks the serial port of a context, returns -1 with errno set
+// (ETIMEDOUT if the lock was not acquired in timeout milliseconds)
+int open_session(solar_ctx *ctx, char *device, speed_t baud, int timeout) {
+	if ((ctx->fd = openserialport(device, baud, timeout, &ctx->stats)) == -1) return -1;
+
+	invalidate_cache(ctx);
+	return 0;
+}
+
+solar_ctx *solar_open(const char *device, int baud, int lock_timeout, int *error) {
+	speed_t speed;
+	if ((device == NULL) || ((speed = serialspeed(baud)) == B0)) {
+		if (error != NULL) *error = SOLAR_EINVAL;
+		return NULL;
+	}
+
+	solar_ctx *ctx;
+	if ((ctx = new_session()) == NULL) {
+		if (error != NULL) *error = SOLAR_ENOMEM;
+		return NULL;
+	}
+
+	if (open_session(ctx, (char *)device, speed, lock_timeout) == -1) {
+		if (error != NULL) *error = (errno == ETIMEDOUT) ? SOLAR_ELOCK : SOLAR_EOPEN;
+		free(ctx);
+		return NULL;
+	}
+
+	if (error != NULL) *error = SOLAR_OK;
+	return ctx;
+}
+
+// Uses an already open serial port, which is closed with the context
+// The port is made non-blocking, as I/O waits for its deadlines with poll
+// Returns NULL with errno set on failure
+solar_ctx *solar_attach(int fd) {
+	int flags;
+	if (((flags = fcntl(fd, F_GETFL)) == -1) || (fcntl(fd, F_SETFL, flags | O_NONBLOCK) == -1)) return NULL;
+
+	solar_ctx *ctx;
+	if ((ctx = new_session()) == NULL) return NULL;
+
+	ctx->fd = fd;
+	return ctx;
+}
+
+// Restores the display if it was used and closes the serial port
+int solar_close(solar_ctx *ctx) {
+	if (ctx == NULL) return SOLAR_EINVAL;
+
+	int ret = SOLAR_OK;
+	if (ctx->fd != -1) {
+		if (finish_session(ctx) == -1) ret = ctx->error;
+		if ((close(ctx->fd) == -1) && (ret == SOLAR_OK)) ret = SOLAR_ECLOSE;
+	}
+
+	free(ctx);
+	return ret;
+}
+
+void solar_set_timeout(solar_ctx *ctx, int timeout) {
+	if (timeout > 0) ctx->reply_timeout = timeout;
+}
+
+void solar_set_pipeline(solar_ctx *ctx, int depth) {
+	if ((depth >= 1) && (depth <= PIPELINE_MAX)) ctx->pipeline_depth = depth;
+}
+
+// Values are read again if they are older than maxage milliseconds (by
+// default by every call), cached for the life of the context if negative
+void solar_set_maxage(solar_ctx *ctx, int maxage) {
+	ctx->cache_maxage = maxage;
+}
+
+void solar_set_reporter(solar_ctx *ctx, void (*report)(solar_ctx *ctx)) {
+	ctx->report = report;
+}
+
+int solar_test(solar_ctx *ctx) {
+	unsigned char frame[FRAME_SIZE];
+	pli_reply reply;
+	encode_request(frame, OP_LOOPBACK, 0x00, 0x00);
+
+	if (exchange(ctx, frame, &reply, 1) == -1) return ctx->error;
+
+	if (reply.kind != REPLY_ACK) {
+		fail(ctx, SOLAR_EPLI, reply.code);
+		return SOLAR_EPLI;
+	}
+	return SOLAR_OK;
+}
+
+// Reads values which change during a day, all in one exchange
+int solar_read(solar_ctx *ctx, solar_values *values) {
+	char *names[] = {"batvoltage", "charge", "load", "state", "day", "time"};
+	metric *metrics[sizeof(names) / sizeof(names[0])];
+	double decoded[sizeof(names) / sizeof(names[0])];
+	int i;
+	for (i = 0; i < sizeof(names) / sizeof(names[0]); i++) {
+		metrics[i] = find_metric(pli_metrics, names[i]);
+	}
+
+	if (read_metrics(ctx, metrics, sizeof(names) / sizeof(names[0]), decoded) == -1) return ctx->error;
+
+	values->batvoltage = decoded[0];
+	values->charge = decoded[1];
+	values->load = decoded[2];
+	values->state = (int)decoded[3];
+	values->day = (int)decoded[4];
+	values->time = (int)decoded[5];
+	return SOLAR_OK;
+}
+
+// Reads a value of a metric by its name, as in 'get' command
+int solar_get(solar_ctx *ctx, const char *name, double *value) {
+	metric *m;
+	if ((name == NULL) || ((m = find_metric(pli_metrics, (char *)name)) == NULL)) return SOLAR_EINVAL;
+
+	if (read_metrics(ctx, &m, 1, value) == -1) return ctx->error;
+	return SOLAR_OK;
+}
+
+// Returns value of a processor register or an error code
+int solar_register(solar_ctx *ctx, int location) {
+	if ((location < 0) || (location > 0xFF)) return SOLAR_EINVAL;
+
+	int value;
+	if ((value = read_processor(ctx, location)) == -1) return ctx->error;
+	return value;
+}
+
+// Error code of the last failure
+int solar_error(solar_ctx *ctx) {
+	return ctx->error;
+}
+
+// errno of the last failure
+int solar_errno(solar_ctx *ctx) {
+	return ctx->errnum;
+}
+
+// Error code sent by PLI in the last SOLAR_EPLI failure
+int solar_code(solar_ctx *ctx) {
+	return ctx->code;
+}
+
+const char *solar_strerror(int error) {
+	if ((error > 0) || (error <= -SOLAR_ERRORS)) return "Unknown error";
+	return error_messages[-error];
+}
+
+const char *solar_state_name(int state) {
+	if ((state < SOLAR_STATE_BOOST) || (state > SOLAR_STATE_FLOAT)) return NULL;
+	return pli_states[state];
+}
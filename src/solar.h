@@ -0,0 +1,58 @@
+#ifndef SOLAR_H_
+#define SOLAR_H_
+
+// Library for reading Plasmatronics PL regulators over a PLI, which keeps all
+// state of a connection in its context, so that many can be used at once
+
+#define SOLAR_OK 0
+#define SOLAR_EINVAL -1 // Invalid argument
+#define SOLAR_ENOMEM -2 // Memory could not be allocated
+#define SOLAR_EOPEN -3 // Serial port could not be opened, see errno
+#define SOLAR_ELOCK -4 // Serial port is locked by another process
+#define SOLAR_EWRITE -5 // Command could not be written, see errno
+#define SOLAR_EREAD -6 // Response could not be read, see errno
+#define SOLAR_ETIMEOUT -7 // Response did not arrive in time
+#define SOLAR_EDESYNC -8 // Response was invalid
+#define SOLAR_EPLI -9 // PLI responded with an error code, see solar_code
+#define SOLAR_ECLOSE -10 // Serial port could not be closed, see errno
+#define SOLAR_ERRORS 11
+
+#define SOLAR_STATE_BOOST 0
+#define SOLAR_STATE_EQUALIZE 1
+#define SOLAR_STATE_ABSORPTION 2
+#define SOLAR_STATE_FLOAT 3
+
+// Only functions of this interface are exported from the shared library,
+// which is built with hidden visibility
+#define SOLAR_API __attribute__((visibility("default")))
+
+typedef struct solar_ctx solar_ctx;
+
+// Values read with solar_read, all in one exchange
+typedef struct {
+	double batvoltage; // V
+	double charge; // A
+	double load; // A
+	int state; // SOLAR_STATE_*
+	int day; // Of a month
+	int time; // Seconds since midnight
+} solar_values;
+
+SOLAR_API solar_ctx *solar_open(const char *device, int baud, int lock_timeout, int *error);
+SOLAR_API solar_ctx *solar_attach(int fd);
+SOLAR_API int solar_close(solar_ctx *ctx);
+SOLAR_API void solar_set_timeout(solar_ctx *ctx, int timeout);
+SOLAR_API void solar_set_pipeline(solar_ctx *ctx, int depth);
+SOLAR_API void solar_set_maxage(solar_ctx *ctx, int maxage);
+SOLAR_API void solar_set_reporter(solar_ctx *ctx, void (*report)(solar_ctx *ctx));
+SOLAR_API int solar_test(solar_ctx *ctx);
+SOLAR_API int solar_read(solar_ctx *ctx, solar_values *values);
+SOLAR_API int solar_get(solar_ctx *ctx, const char *name, double *value);
+SOLAR_API int solar_register(solar_ctx *ctx, int location);
+SOLAR_API int solar_error(solar_ctx *ctx);
+SOLAR_API int solar_errno(solar_ctx *ctx);
+SOLAR_API int solar_code(solar_ctx *ctx);
+SOLAR_API const char *solar_strerror(int error);
+SOLAR_API const char *solar_state_name(int state);
+
+#endif /* SOLAR_H_ */
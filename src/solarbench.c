@@ -0,0 +1,429 @@
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <signal.h>
+#include <limits.h>
+#include <math.h>
+#include <time.h>
+#include <dirent.h>
+#include <sys/wait.h>
+
+#include "solarbench.h"
+
+// Runs solar commands repeatedly against a serial port device or against the
+// simulator and reports their latency, serial port traffic and lock usage as
+// reported by solar's --stats
+
+static char solar[PATH_MAX];
+static char workdir[] = "/tmp/solarbench.XXXXXX";
+static char *device = NULL;
+static char lock_timeout[16];
+
+static void printhelp(FILE *output) {
+	fprintf(output, "solarbench [-s <solar>] [-S <solarsim>] [-d <device>] [-l <latency>] [-n <count>]\n");
+	fprintf(output, "           [-c <processes>] [-r <rounds>] [-w <timeout>] [<command>[,<command>...]...]\n");
+	fprintf(output, "  -s <solar>     benchmark <solar> program (default: %s)\n", DEFAULT_BENCH_SOLAR);
+	fprintf(output, "  -S <solarsim>  run <solarsim> simulator when no device is given (default: %s)\n", DEFAULT_BENCH_SOLARSIM);
+	fprintf(output, "  -d <device>    use <device> as a serial port device file instead of the simulator\n");
+	fprintf(output, "  -l <latency>   simulator replies after <latency> milliseconds (default: %d)\n", DEFAULT_BENCH_LATENCY);
+	fprintf(output, "  -n <count>     run every command <count> times (default: %d)\n", DEFAULT_BENCH_ITERATIONS);
+	fprintf(output, "  -c <processes> run <processes> concurrent processes in contention scenario (default: %d)\n", DEFAULT_BENCH_PROCESSES);
+	fprintf(output, "  -r <rounds>    run contention scenario <rounds> times, 0 to skip it (default: %d)\n", DEFAULT_BENCH_ROUNDS);
+	fprintf(output, "  -w <timeout>   processes wait at most <timeout> milliseconds for serial port lock\n");
+	fprintf(output, "                 in contention scenario (default: %d)\n", DEFAULT_BENCH_LOCK_TIMEOUT);
+	fprintf(output, "\n");
+	fprintf(output, "  <command>      solar command to benchmark, commands joined with commas are run in one\n");
+	fprintf(output, "                 session (default: all interface commands which only read values)\n");
+}
+
+static long long monotonic_us() {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (long long)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+static int compare(const void *a, const void *b) {
+	long long x = *(const long long *)a;
+	long long y = *(const long long *)b;
+	return (x > y) - (x < y);
+}
+
+// Nearest-rank percentile of sorted values
+static long long percentile(long long *values, int count, int p) {
+	if (count == 0) return 0;
+	int rank = (int)ceil(p / 100.0 * count);
+	return values[(rank > 0) ? (rank - 1) : 0];
+}
+
+// Starts solar with given arguments in the working directory, standard output
+// is discarded and standard error is stored into a file for the index
+static pid_t spawn(char *args[], int index) {
+	pid_t pid = fork();
+	if (pid != 0) return pid;
+
+	char path[PATH_MAX];
+	snprintf(path, sizeof(path), "%s/stderr.%d", workdir, index);
+
+	int output;
+	int errors;
+	if ((chdir(workdir) == -1) || ((output = open("/dev/null", O_WRONLY)) == -1) || ((errors = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644)) == -1)) {
+		fprintf(stderr, "Could not prepare benchmark process: %s.\n", strerror(errno));
+		_exit(127);
+	}
+	dup2(output, STDOUT_FILENO);
+	dup2(errors, STDERR_FILENO);
+
+	execv(solar, args);
+	fprintf(stderr, "Could not run '%s': %s.\n", solar, strerror(errno));
+	_exit(127);
+}
+
+// Waits for a process started with spawn and parses what it reported
+static int finish(pid_t pid, int index, long long start, bench_run *run) {
+	int status;
+	while (waitpid(pid, &status, 0) == -1) {
+		if (errno != EINTR) return -1;
+	}
+	run->latency = monotonic_us() - start;
+	run->status = WIFEXITED(status) ? WEXITSTATUS(status) : 128;
+	run->lock_timeout = 0;
+	run->measured = 0;
+
+	char path[PATH_MAX];
+	snprintf(path, sizeof(path), "%s/stderr.%d", workdir, index);
+
+	FILE *errors;
+	if ((errors = fopen(path, "r")) == NULL) return 0;
+
+	char line[512];
+	while (fgets(line, sizeof(line), errors) != NULL) {
+		if (strncmp(line, "Timeout while waiting for serial port", 37) == 0) run->lock_timeout = 1;
+		if (sscanf(line, "Statistics: %lld transactions, %lld bytes written, %lld bytes read, %lld ms waiting for lock, %lld ms holding lock.", &run->transactions, &run->written, &run->read, &run->lock_wait, &run->lock_held) == 5) run->measured = 1;
+	}
+	fclose(errors);
+
+	return 0;
+}
+
+// Builds solar arguments for a comma separated list of commands
+static void arguments(char *commands, char *args[], char *buffer, int size, char *timeout) {
+	int count = 0;
+	args[count++] = solar;
+	args[count++] = "--stats";
+	args[count++] = "-d";
+	args[count++] = device;
+	if (timeout != NULL) {
+		args[count++] = "-w";
+		args[count++] = timeout;
+	}
+
+	snprintf(buffer, size, "%s", commands);
+	char *saved;
+	char *name;
+	for (name = strtok_r(buffer, ",", &saved); (name != NULL) && (count < BENCH_ARGUMENTS - 1); name = strtok_r(NULL, ",", &saved)) {
+		args[count++] = name;
+	}
+	args[count] = NULL;
+}
+
+static void bench_command(char *commands, int iterations) {
+	char *args[BENCH_ARGUMENTS];
+	char buffer[256];
+	arguments(commands, args, buffer, sizeof(buffer), NULL);
+
+	long long latencies[iterations];
+	long long transactions = 0;
+	long long bytes = 0;
+	long long held = 0;
+	int measured = 0;
+	int failed = 0;
+
+	int i;
+	for (i = 0; i < iterations; i++) {
+		bench_run run;
+		long long start = monotonic_us();
+		pid_t pid = spawn(args, 0);
+		if ((pid == -1) || (finish(pid, 0, start, &run) == -1)) {
+			fprintf(stderr, "Could not run '%s': %s.\n", solar, strerror(errno));
+			return;
+		}
+		latencies[i] = run.latency;
+		if (run.status != 0) failed++;
+		if (run.measured != 0) {
+			transactions += run.transactions;
+			bytes += run.written + run.read;
+			held += run.lock_held;
+			measured++;
+		}
+	}
+
+	qsort(latencies, iterations, sizeof(long long), compare);
+	if (measured == 0) measured = 1;
+	printf("%-24s %8.1f %8.1f %8.1f %8.1f %8.1f %9.1f %6d\n", commands, percentile(latencies, iterations, 50) / 1000.0, percentile(latencies, iterations, 95) / 1000.0, percentile(latencies, iterations, 99) / 1000.0, (double)transactions / measured, (double)bytes / measured, (double)held / measured, failed);
+}
+
+// Runs processes concurrently, all reading the same value, and measures how
+// long they wait for the serial port lock and how many of them give up
+static void bench_contention(int processes, int rounds) {
+	char *args[BENCH_ARGUMENTS];
+	char buffer[256];
+	arguments("batvoltage", args, buffer, sizeof(buffer), lock_timeout);
+
+	int total = processes * rounds;
+	long long waits[total];
+	long long latencies[total];
+	int timeouts = 0;
+	int failed = 0;
+	int count = 0;
+
+	int r;
+	for (r = 0; r < rounds; r++) {
+		pid_t pids[processes];
+		long long starts[processes];
+		int i;
+		for (i = 0; i < processes; i++) {
+			starts[i] = monotonic_us();
+			if ((pids[i] = spawn(args, i)) == -1) {
+				fprintf(stderr, "Could not run '%s': %s.\n", solar, strerror(errno));
+				processes = i;
+				break;
+			}
+		}
+		for (i = 0; i < processes; i++) {
+			bench_run run;
+			if (finish(pids[i], i, starts[i], &run) == -1) continue;
+			latencies[count] = run.latency;
+			waits[count] = (run.measured != 0) ? run.lock_wait : 0;
+			count++;
+			if (run.lock_timeout != 0) timeouts++;
+			else if (run.status != 0) failed++;
+		}
+	}
+
+	qsort(waits, count, sizeof(long long), compare);
+	qsort(latencies, count, sizeof(long long), compare);
+
+	printf("\nContention: %d processes, %d rounds, lock timeout %s ms\n", processes, rounds, lock_timeout);
+	printf("Lock wait (ms): p50 %lld, p95 %lld, p99 %lld, max %lld\n", percentile(waits, count, 50), percentile(waits, count, 95), percentile(waits, count, 99), (count > 0) ? waits[count - 1] : 0);
+	printf("Latency (ms): p50 %.1f, p95 %.1f, p99 %.1f\n", percentile(latencies, count, 50) / 1000.0, percentile(latencies, count, 95) / 1000.0, percentile(latencies, count, 99) / 1000.0);
+	printf("Lock timeouts: %d of %d (%.1f%%), other failures: %d\n", timeouts, count, (count > 0) ? 100.0 * timeouts / count : 0.0, failed);
+}
+
+// Gets names of interface commands from solar's CSV help output with their flags
+static int list_commands(char *commands[], int size) {
+	char *args[] = {solar, "-o", "csv", "help", NULL};
+	int pipefd[2];
+	if (pipe(pipefd) == -1) return -1;
+
+	pid_t pid = fork();
+	if (pid == -1) return -1;
+	if (pid == 0) {
+		dup2(pipefd[1], STDOUT_FILENO);
+		close(pipefd[0]);
+		execv(solar, args);
+		_exit(127);
+	}
+	close(pipefd[1]);
+
+	FILE *output = fdopen(pipefd[0], "r");
+	char line[128];
+	int count = 0;
+	while ((fgets(line, sizeof(line), output) != NULL) && (count < size)) {
+		char name[64];
+		int builtin;
+		int args;
+		int endless;
+		int changes;
+		int files;
+		if (sscanf(line, "%63[^,],%d,%d,%d,%d,%d", name, &builtin, &args, &endless, &changes, &files) != 6) continue;
+
+		// Builtin commands do not use the serial port, and commands which take
+		// arguments, do not return or change regulator state are not
+		// benchmarked by default
+		if ((builtin != 0) || (args != 0) || (endless != 0) || (changes != 0)) continue;
+		commands[count++] = strdup(name);
+	}
+	fclose(output);
+	waitpid(pid, NULL, 0);
+
+	return count;
+}
+
+// Starts the simulator and reads the device file it prints
+static pid_t start_simulator(char *path, int latency) {
+	char delay[16];
+	snprintf(delay, sizeof(delay), "%d", latency);
+	char *args[] = {path, "-l", delay, NULL};
+
+	int pipefd[2];
+	if (pipe(pipefd) == -1) return -1;
+
+	pid_t pid = fork();
+	if (pid == -1) return -1;
+	if (pid == 0) {
+		dup2(pipefd[1], STDOUT_FILENO);
+		close(pipefd[0]);
+		int errors = open("/dev/null", O_WRONLY);
+		if (errors != -1) dup2(errors, STDERR_FILENO);
+		execv(path, args);
+		_exit(127);
+	}
+	close(pipefd[1]);
+
+	static char line[PATH_MAX];
+	FILE *output = fdopen(pipefd[0], "r");
+	if (fgets(line, sizeof(line), output) == NULL) {
+		fclose(output);
+		kill(pid, SIGTERM);
+		waitpid(pid, NULL, 0);
+		errno = ENOENT;
+		return -1;
+	}
+	fclose(output);
+	line[strcspn(line, "\n")] = '\0';
+	device = line;
+
+	return pid;
+}
+
+static void cleanup() {
+	DIR *dir;
+	if ((dir = opendir(workdir)) == NULL) return;
+
+	struct dirent *entry;
+	while ((entry = readdir(dir)) != NULL) {
+		if (entry->d_name[0] == '.') continue;
+		char path[PATH_MAX];
+		snprintf(path, sizeof(path), "%s/%s", workdir, entry->d_name);
+		unlink(path);
+	}
+	closedir(dir);
+	rmdir(workdir);
+}
+
+static int parse_number(char *option, char *value, int minimum) {
+	char *end;
+	int number = strtol(value, &end, 10);
+	if ((*end != '\0') || (number < minimum)) {
+		fprintf(stderr, "Invalid parameter '%s' for %s argument.\n\n", value, option);
+		printhelp(stderr);
+		return -1;
+	}
+	return number;
+}
+
+int main(int argc, char *argv[]) {
+	char *solar_path = DEFAULT_BENCH_SOLAR;
+	char *simulator = DEFAULT_BENCH_SOLARSIM;
+	int latency = DEFAULT_BENCH_LATENCY;
+	int iterations = DEFAULT_BENCH_ITERATIONS;
+	int processes = DEFAULT_BENCH_PROCESSES;
+	int rounds = DEFAULT_BENCH_ROUNDS;
+	snprintf(lock_timeout, sizeof(lock_timeout), "%d", DEFAULT_BENCH_LOCK_TIMEOUT);
+
+	char *commands[BENCH_COMMANDS];
+	int count = 0;
+
+	int i;
+	for (i = 1; i < argc; i++) {
+		if ((strcmp(argv[i], "-h") == 0) || (strcmp(argv[i], "--help") == 0)) {
+			printhelp(stdout);
+			return 0;
+		}
+		else if ((argv[i][0] == '-') && (argv[i][1] != '\0') && (argv[i][2] == '\0') && (strchr("sSdlncrw", argv[i][1]) != NULL)) {
+			char *option = argv[i];
+			i++;
+			if ((i >= argc) || (argv[i][0] == '\0')) {
+				fprintf(stderr, "Missing parameter for %s argument.\n\n", option);
+				printhelp(stderr);
+				return 1;
+			}
+
+			switch (option[1]) {
+				case 's':
+					solar_path = argv[i];
+					break;
+				case 'S':
+					simulator = argv[i];
+					break;
+				case 'd':
+					device = argv[i];
+					break;
+				case 'l':
+					if ((latency = parse_number(option, argv[i], 0)) == -1) return 1;
+					break;
+				case 'n':
+					if ((iterations = parse_number(option, argv[i], 1)) == -1) return 1;
+					break;
+				case 'c':
+					if ((processes = parse_number(option, argv[i], 1)) == -1) return 1;
+					if (processes > BENCH_PROCESSES_MAX) processes = BENCH_PROCESSES_MAX;
+					break;
+				case 'r':
+					if ((rounds = parse_number(option, argv[i], 0)) == -1) return 1;
+					break;
+				case 'w':
+					if (parse_number(option, argv[i], 0) == -1) return 1;
+					snprintf(lock_timeout, sizeof(lock_timeout), "%s", argv[i]);
+					break;
+			}
+		}
+		else if (argv[i][0] == '-') {
+			fprintf(stderr, "Unknown argument '%s'.\n\n", argv[i]);
+			printhelp(stderr);
+			return 1;
+		}
+		else if (count < BENCH_COMMANDS) {
+			commands[count++] = argv[i];
+		}
+	}
+
+	// Processes run in a temporary directory, so paths have to be absolute
+	if (realpath(solar_path, solar) == NULL) {
+		fprintf(stderr, "Could not find '%s': %s.\n", solar_path, strerror(errno));
+		return 2;
+	}
+
+	if ((count == 0) && ((count = list_commands(commands, BENCH_COMMANDS)) <= 0)) {
+		fprintf(stderr, "Could not get commands of '%s'.\n", solar);
+		return 2;
+	}
+
+	if (mkdtemp(workdir) == NULL) {
+		fprintf(stderr, "Could not create working directory: %s.\n", strerror(errno));
+		return 2;
+	}
+
+	pid_t simulator_pid = -1;
+	if (device == NULL) {
+		if ((simulator_pid = start_simulator(simulator, latency)) == -1) {
+			fprintf(stderr, "Could not start simulator '%s': %s.\n", simulator, strerror(errno));
+			cleanup();
+			return 2;
+		}
+		printf("Simulator on %s with %d ms latency\n\n", device, latency);
+	}
+	else {
+		printf("Device %s\n\n", device);
+	}
+
+	printf("%-24s %8s %8s %8s %8s %8s %9s %6s\n", "Command", "p50 ms", "p95 ms", "p99 ms", "trans", "bytes", "locked ms", "failed");
+	for (i = 0; i < count; i++) {
+		bench_command(commands[i], iterations);
+	}
+
+	if (rounds > 0) bench_contention(processes, rounds);
+
+	if (simulator_pid != -1) {
+		kill(simulator_pid, SIGTERM);
+		waitpid(simulator_pid, NULL, 0);
+	}
+	cleanup();
+
+	return 0;
+}
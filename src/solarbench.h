@@ -0,0 +1,28 @@
+#ifndef SOLARBENCH_H_
+#define SOLARBENCH_H_
+
+#define DEFAULT_BENCH_SOLAR "./solar"
+#define DEFAULT_BENCH_SOLARSIM "./solarsim"
+#define DEFAULT_BENCH_ITERATIONS 20
+#define DEFAULT_BENCH_PROCESSES 4
+#define DEFAULT_BENCH_ROUNDS 10
+#define DEFAULT_BENCH_LATENCY 5
+#define DEFAULT_BENCH_LOCK_TIMEOUT 1000
+#define BENCH_COMMANDS 64
+#define BENCH_ARGUMENTS 32
+#define BENCH_PROCESSES_MAX 64
+
+// Measurements of one solar process
+typedef struct {
+	long long latency; // Microseconds from start to exit
+	int status; // Exit status
+	int lock_timeout; // Whether it timed out waiting for serial port lock
+	int measured; // Whether the rest was reported by solar
+	long long transactions;
+	long long written;
+	long long read;
+	long long lock_wait; // Milliseconds
+	long long lock_held; // Milliseconds
+} bench_run;
+
+#endif /* SOLARBENCH_H_ */
@@ -0,0 +1,415 @@
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <signal.h>
+#include <poll.h>
+#include <time.h>
+#include <termios.h>
+
+#include "solarsim.h"
+#include "serial.h"
+#include "frame.h"
+
+// Simulates a Plasmatronics PL regulator behind a PLI on a pseudo-terminal,
+// so that solar can be run and measured without the hardware
+
+static unsigned char ram[SIM_MEMORY_SIZE];
+static unsigned char eeprom[SIM_MEMORY_SIZE];
+
+static int latency = DEFAULT_SIM_LATENCY;
+static int echo = 0;
+static int drop_rate = 0;
+static int error_rate = 0;
+static int verbose = 0;
+static long long clock_tick = 0; // Monotonic time of the next tick of the regulator clock, 0 if it is stopped
+static speed_t baud = B0; // Any if B0
+static int slave = -1;
+
+static sim_stats stats;
+static volatile sig_atomic_t running = 1;
+
+static void stop(int signal) {
+	running = 0;
+}
+
+static void printhelp(FILE *output) {
+	fprintf(output, "solarsim [-l <latency>] [-e] [-x <percent>] [-E <percent>] [-S <seed>] [-b <baud>] [-r <file>] [-m <file>] [-c] [-v]\n");
+	fprintf(output, "  -l <latency>   reply after <latency> milliseconds (default: %d)\n", DEFAULT_SIM_LATENCY);
+	fprintf(output, "  -e             echo request before reply data, as PLI does when data is not ready\n");
+	fprintf(output, "  -x <percent>   drop <percent> of reply bytes (default: 0)\n");
+	fprintf(output, "  -E <percent>   reply with an error code to <percent> of requests (default: 0)\n");
+	fprintf(output, "  -S <seed>      seed random drops and errors with <seed> (default: 1)\n");
+	fprintf(output, "  -b <baud>      garble frames sent at another baud than <baud> (default: any baud)\n");
+	fprintf(output, "  -r <file>      load processor RAM image from <file>\n");
+	fprintf(output, "  -m <file>      load EEPROM image from <file>\n");
+	fprintf(output, "  -c             advance the regulator clock every second\n");
+	fprintf(output, "  -v             log frames to standard error\n");
+	fprintf(output, "\n");
+	fprintf(output, "Prints the pseudo-terminal device file to use with solar's -d argument.\n");
+}
+
+// Registers have values of a regulator with a charged battery on a sunny day
+static void default_images() {
+	memset(ram, 0, sizeof(ram));
+	memset(eeprom, 0, sizeof(eeprom));
+
+	ram[0x00] = 7; // Version
+	ram[0x20] = 1; // Battery voltage high bits
+	ram[0x2E] = 42; // Seconds
+	ram[0x2F] = 3; // Minutes
+	ram[0x30] = 125; // Tenths of an hour
+	ram[0x31] = 4; // Day
+	ram[0x32] = 130; // Battery voltage
+	ram[0x35] = 40; // Solar voltage
+	ram[0x5E] = 10; // Battery capacity
+	ram[0x65] = 3; // Regulator state
+	ram[0xCD] = 3; // External charge
+	ram[0xCE] = 4; // External load
+	ram[0xCF] = 1; // External current ranges
+	ram[0xD5] = 55; // Internal charge
+	ram[0xD9] = 20; // Internal load
+
+	// Daily log, today first
+	int i;
+	for (i = 0; i < 24; i++) {
+		ram[0x68 + i] = 120 + i % 5; // Minimum battery voltage
+		ram[0x80 + i] = 140 - i % 3; // Maximum battery voltage
+		ram[0x98 + i] = 40 + i; // Charge in Ah
+		ram[0xB0 + i] = 30 + i % 7; // Load in Ah
+	}
+
+	for (i = 0; i < SIM_MEMORY_SIZE; i++) {
+		eeprom[i] = i;
+	}
+}
+
+static int load_image(char *path, unsigned char *image) {
+	int file;
+	if ((file = open(path, O_RDONLY)) == -1) {
+		fprintf(stderr, "Could not open image file '%s': %s.\n", path, strerror(errno));
+		return -1;
+	}
+
+	int count;
+	int r = 0;
+	while ((r < SIM_MEMORY_SIZE) && ((count = read(file, image + r, SIM_MEMORY_SIZE - r)) != 0)) {
+		if (count == -1) {
+			if (errno == EINTR) continue;
+			fprintf(stderr, "Could not read image file '%s': %s.\n", path, strerror(errno));
+			close(file);
+			return -1;
+		}
+		r += count;
+	}
+	close(file);
+
+	if (r != SIM_MEMORY_SIZE) {
+		fprintf(stderr, "Invalid image file '%s'.\n", path);
+		return -1;
+	}
+
+	return 0;
+}
+
+static int chance(int percent) {
+	return (percent > 0) && ((rand() % 100) < percent);
+}
+
+static void log_frame(char *direction, unsigned char *frame, int size) {
+	if (verbose == 0) return;
+
+	fprintf(stderr, "%s", direction);
+	int i;
+	for (i = 0; i < size; i++) {
+		fprintf(stderr, " %02X", frame[i]);
+	}
+	fprintf(stderr, "\n");
+}
+
+// Sends a reply, dropping bytes with the configured rate
+static void reply(int master, unsigned char *buffer, int size) {
+	unsigned char sent[SIM_FRAME_SIZE];
+	int count = 0;
+	int i;
+	for (i = 0; i < size; i++) {
+		if (chance(drop_rate)) stats.dropped++;
+		else sent[count++] = buffer[i];
+	}
+
+	log_frame("<", sent, count);
+	if ((count > 0) && (write_until(master, sent, count, monotonic_ms() + 1000) == -1)) {
+		fprintf(stderr, "Could not write to pseudo-terminal: %s.\n", strerror(errno));
+	}
+}
+
+// Advances clock registers by the seconds which passed since the last tick,
+// a write of the seconds register starts a new second
+static void advance_clock() {
+	if (clock_tick == 0) return;
+
+	long long now = monotonic_ms();
+	for (; clock_tick <= now; clock_tick += 1000) {
+		if (++ram[0x2E] < 60) continue;
+		ram[0x2E] = 0;
+		if (++ram[0x2F] < 6) continue;
+		ram[0x2F] = 0;
+		if (++ram[0x30] < 240) continue;
+		ram[0x30] = 0;
+		ram[0x31]++;
+	}
+}
+
+static void handle(int master, unsigned char *frame) {
+	unsigned char op = frame[0];
+	unsigned char location = frame[1];
+	unsigned char data = frame[2];
+
+	stats.frames++;
+	log_frame(">", frame, SIM_FRAME_SIZE);
+
+	// Bytes sent at a wrong baud arrive as something else
+	struct termios options;
+	if ((baud != B0) && (tcgetattr(slave, &options) == 0) && (cfgetospeed(&options) != baud)) {
+		unsigned char garbage[] = {frame[0] ^ 0x5A};
+		stats.garbled++;
+		reply(master, garbage, sizeof(garbage));
+		return;
+	}
+
+	if (!request_valid(frame)) {
+		unsigned char error[] = {0x82};
+		stats.errors++;
+		reply(master, error, sizeof(error));
+		return;
+	}
+
+	advance_clock();
+
+	// Writes and push commands have no reply
+	switch (op) {
+		case 0x98:
+			ram[location] = data;
+			if ((location == 0x2E) && (clock_tick != 0)) clock_tick = monotonic_ms() + 1000;
+			return;
+		case 0xCA:
+			eeprom[location] = data;
+			return;
+		case 0x57:
+			return;
+		case 0x14:
+		case 0x48:
+		case 0xBB:
+			break;
+		default: {
+			unsigned char error[] = {0x83};
+			stats.errors++;
+			reply(master, error, sizeof(error));
+			return;
+		}
+	}
+
+	if (echo != 0) reply(master, frame, SIM_FRAME_SIZE);
+
+	sleep_ms(latency);
+
+	if (chance(error_rate)) {
+		unsigned char codes[] = {0x81, 0x85, 0x86};
+		unsigned char error[] = {codes[rand() % sizeof(codes)]};
+		stats.errors++;
+		reply(master, error, sizeof(error));
+		return;
+	}
+
+	stats.replies++;
+	if (op == 0xBB) {
+		unsigned char response[] = {0x80};
+		reply(master, response, sizeof(response));
+	}
+	else {
+		unsigned char response[] = {0xC8, (op == 0x14) ? ram[location] : eeprom[location]};
+		reply(master, response, sizeof(response));
+	}
+}
+
+static int parse_percent(char *option, char *value) {
+	char *end;
+	int percent = strtol(value, &end, 10);
+	if ((*end != '\0') || (percent < 0) || (percent > 100)) {
+		fprintf(stderr, "Invalid parameter '%s' for %s argument.\n\n", value, option);
+		printhelp(stderr);
+		return -1;
+	}
+	return percent;
+}
+
+int main(int argc, char *argv[]) {
+	char *ram_file = NULL;
+	char *eeprom_file = NULL;
+	unsigned int seed = 1;
+
+	int i;
+	for (i = 1; i < argc; i++) {
+		if (strcmp(argv[i], "-c") == 0) {
+			clock_tick = monotonic_ms() + 1000;
+		}
+		else if (strcmp(argv[i], "-e") == 0) {
+			echo = 1;
+		}
+		else if (strcmp(argv[i], "-v") == 0) {
+			verbose = 1;
+		}
+		else if ((strcmp(argv[i], "-l") == 0) || (strcmp(argv[i], "-x") == 0) || (strcmp(argv[i], "-E") == 0) || (strcmp(argv[i], "-S") == 0) || (strcmp(argv[i], "-b") == 0) || (strcmp(argv[i], "-r") == 0) || (strcmp(argv[i], "-m") == 0)) {
+			char *option = argv[i];
+			i++;
+			if ((i >= argc) || (argv[i][0] == '\0')) {
+				fprintf(stderr, "Missing parameter for %s argument.\n\n", option);
+				printhelp(stderr);
+				return 1;
+			}
+
+			if (strcmp(option, "-l") == 0) {
+				char *end;
+				latency = strtol(argv[i], &end, 10);
+				if ((*end != '\0') || (latency < 0)) {
+					fprintf(stderr, "Invalid parameter '%s' for -l argument.\n\n", argv[i]);
+					printhelp(stderr);
+					return 1;
+				}
+			}
+			else if (strcmp(option, "-x") == 0) {
+				if ((drop_rate = parse_percent(option, argv[i])) == -1) return 1;
+			}
+			else if (strcmp(option, "-E") == 0) {
+				if ((error_rate = parse_percent(option, argv[i])) == -1) return 1;
+			}
+			else if (strcmp(option, "-S") == 0) {
+				char *end;
+				seed = strtoul(argv[i], &end, 10);
+				if (*end != '\0') {
+					fprintf(stderr, "Invalid parameter '%s' for -S argument.\n\n", argv[i]);
+					printhelp(stderr);
+					return 1;
+				}
+			}
+			else if (strcmp(option, "-b") == 0) {
+				char *end;
+				int b = strtol(argv[i], &end, 10);
+				if ((*end != '\0') || ((baud = serialspeed(b)) == B0)) {
+					fprintf(stderr, "Invalid parameter '%s' for -b argument.\n\n", argv[i]);
+					printhelp(stderr);
+					return 1;
+				}
+			}
+			else if (strcmp(option, "-r") == 0) {
+				ram_file = argv[i];
+			}
+			else {
+				eeprom_file = argv[i];
+			}
+		}
+		else if ((strcmp(argv[i], "-h") == 0) || (strcmp(argv[i], "--help") == 0)) {
+			printhelp(stdout);
+			return 0;
+		}
+		else {
+			fprintf(stderr, "Unknown argument '%s'.\n\n", argv[i]);
+			printhelp(stderr);
+			return 1;
+		}
+	}
+
+	srand(seed);
+	default_images();
+	if ((ram_file != NULL) && (load_image(ram_file, ram) == -1)) return 2;
+	if ((eeprom_file != NULL) && (load_image(eeprom_file, eeprom) == -1)) return 2;
+
+	int master;
+	if (((master = posix_openpt(O_RDWR | O_NOCTTY)) == -1) || (grantpt(master) == -1) || (unlockpt(master) == -1)) {
+		fprintf(stderr, "Could not open pseudo-terminal: %s.\n", strerror(errno));
+		return 2;
+	}
+
+	char *device = ptsname(master);
+	if (device == NULL) {
+		fprintf(stderr, "Could not open pseudo-terminal: %s.\n", strerror(errno));
+		return 2;
+	}
+
+	// Slave side is kept open so that the master does not get a hangup when
+	// clients close it, and is in raw mode until clients configure it themselves
+	if ((slave = open(device, O_RDWR | O_NOCTTY)) == -1) {
+		fprintf(stderr, "Could not open pseudo-terminal '%s': %s.\n", device, strerror(errno));
+		return 2;
+	}
+	struct termios options;
+	if (tcgetattr(slave, &options) == 0) {
+		cfmakeraw(&options);
+		tcsetattr(slave, TCSANOW, &options);
+	}
+
+	if (fcntl(master, F_SETFL, fcntl(master, F_GETFL) | O_NONBLOCK) == -1) {
+		fprintf(stderr, "Could not configure pseudo-terminal: %s.\n", strerror(errno));
+		return 2;
+	}
+
+	struct sigaction action;
+	memset(&action, 0, sizeof(action));
+	action.sa_handler = stop;
+	sigaction(SIGTERM, &action, NULL);
+	sigaction(SIGINT, &action, NULL);
+
+	fprintf(stdout, "%s\n", device);
+	fflush(stdout);
+
+	unsigned char frame[SIM_FRAME_SIZE];
+	int received = 0;
+	long long started = 0;
+	while (running) {
+		struct pollfd descriptor = {master, POLLIN, 0};
+		int timeout = -1;
+		if (received > 0) {
+			long long left = started + SIM_FRAME_TIMEOUT - monotonic_ms();
+			timeout = (left > 0) ? left : 0;
+		}
+
+		int ready = poll(&descriptor, 1, timeout);
+		if (ready == -1) {
+			if (errno == EINTR) continue;
+			fprintf(stderr, "Could not wait for pseudo-terminal: %s.\n", strerror(errno));
+			return 2;
+		}
+		if (ready == 0) {
+			// PLI discards an incomplete frame after a while
+			log_frame("discarded", frame, received);
+			stats.discarded++;
+			received = 0;
+			continue;
+		}
+
+		int count;
+		if ((count = read(master, frame + received, SIM_FRAME_SIZE - received)) == -1) {
+			if ((errno == EINTR) || (errno == EAGAIN)) continue;
+			fprintf(stderr, "Could not read from pseudo-terminal: %s.\n", strerror(errno));
+			return 2;
+		}
+		if (received == 0) started = monotonic_ms();
+		received += count;
+
+		if (received == SIM_FRAME_SIZE) {
+			handle(master, frame);
+			received = 0;
+		}
+	}
+
+	fprintf(stderr, "Frames: %lu, replies: %lu, errors: %lu, dropped bytes: %lu, discarded frames: %lu, garbled frames: %lu\n", stats.frames, stats.replies, stats.errors, stats.dropped, stats.discarded, stats.garbled);
+
+	close(slave);
+	close(master);
+
+	return 0;
+}
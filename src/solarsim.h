@@ -0,0 +1,19 @@
+#ifndef SOLARSIM_H_
+#define SOLARSIM_H_
+
+#define SIM_FRAME_SIZE 4
+#define SIM_MEMORY_SIZE 256
+#define SIM_FRAME_TIMEOUT 100 // Partially received frame is discarded after this many milliseconds
+#define DEFAULT_SIM_LATENCY 0
+
+// Counters reported when the simulator exits
+typedef struct {
+	unsigned long frames;
+	unsigned long replies;
+	unsigned long errors;
+	unsigned long dropped;
+	unsigned long discarded;
+	unsigned long garbled;
+} sim_stats;
+
+#endif /* SOLARSIM_H_ */
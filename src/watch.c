@@ -0,0 +1,258 @@
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <errno.h>
+#include <unistd.h>
+#include <signal.h>
+#include <time.h>
+#include <math.h>
+
+#include "watch.h"
+#include "main.h"
+#include "pli.h"
+#include "protocol.h"
+#include "serial.h"
+#include "output.h"
+
+// Keeps the session open and reads registers behind watched metrics every
+// interval seconds, but outputs only events: a value moving by more than its
+// deadband, crossing one of its thresholds or failing to be read
+
+// Parses <metric>[:<deadband>][@<threshold>,...][~<hysteresis>]
+static int parse_watch(char *argument, watched_metric *w) {
+	memset(w, 0, sizeof(watched_metric));
+	w->deadband = -1;
+	w->changes = 1;
+	w->last = NAN;
+
+	char name[32];
+	int length = strcspn(argument, ":@~");
+	if (length >= sizeof(name)) return -1;
+	memcpy(name, argument, length);
+	name[length] = '\0';
+	if ((w->m = find_metric(pli_metrics, name)) == NULL) return -1;
+
+	char *c = argument + length;
+	char *end;
+	if (*c == ':') {
+		w->deadband = strtod(c + 1, &end);
+		if ((end == c + 1) || (w->deadband < 0)) return -1;
+		c = end;
+	}
+	if (*c == '@') {
+		// Only crossings are reported unless a deadband is given as well
+		if (w->deadband < 0) w->changes = 0;
+		do {
+			if (w->thresholds_count == WATCH_THRESHOLDS) return -1;
+			w->thresholds[w->thresholds_count++] = strtod(c + 1, &end);
+			if (end == c + 1) return -1;
+			c = end;
+		} while (*c == ',');
+
+		// By default noise in the last output digit does not cross a threshold
+		// back and forth
+		int i;
+		w->hysteresis = 1;
+		for (i = 0; i < w->m->precision; i++) {
+			w->hysteresis /= 10;
+		}
+		if (*c == '~') {
+			w->hysteresis = strtod(c + 1, &end);
+			if ((end == c + 1) || (w->hysteresis < 0)) return -1;
+			c = end;
+		}
+	}
+
+	return (*c == '\0') ? 0 : -1;
+}
+
+// Without a deadband a value has changed when its output changes, so that
+// noise below the output precision is not reported
+static int changed(watched_metric *w, double value) {
+	if (w->deadband >= 0) return fabs(value - w->reported) > w->deadband;
+
+	char previous[32];
+	char current[32];
+	format_metric(w->m, w->reported, previous, sizeof(previous));
+	format_metric(w->m, value, current, sizeof(current));
+	return strcmp(previous, current) != 0;
+}
+
+// Runs the hook command in the background with the event in environment
+// variables; the child must not keep the serial port open and locked
+static void run_hook(solar_ctx *ctx, watched_metric *w, char *event, char *text, char *previous, double threshold) {
+	fflush(out);
+
+	pid_t pid = fork();
+	if (pid == -1) {
+		fprintf(stderr, "Could not run hook command: %s.\n", strerror(errno));
+		return;
+	}
+	if (pid > 0) return;
+
+	close(ctx->fd);
+
+	char value[32] = "";
+	if (!isnan(threshold)) snprintf(value, sizeof(value), "%.*f", w->m->precision, threshold);
+	setenv("SOLAR_EVENT", event, 1);
+	setenv("SOLAR_METRIC", w->m->name, 1);
+	setenv("SOLAR_VALUE", text, 1);
+	setenv("SOLAR_PREVIOUS", previous, 1);
+	setenv("SOLAR_THRESHOLD", value, 1);
+
+	execl("/bin/sh", "sh", "-c", hook_command, (char *)NULL);
+	fprintf(stderr, "Could not run hook command: %s.\n", strerror(errno));
+	_exit(127);
+}
+
+// Outputs an event, value is NAN if it could not be read, previous and
+// threshold are NAN if it has none
+static void emit(solar_ctx *ctx, watched_metric *w, char *event, double value, double previous, double threshold) {
+	struct timespec now;
+	clock_gettime(CLOCK_REALTIME, &now);
+
+	char text[32] = "";
+	char before[32] = "";
+	if (!isnan(value)) format_metric(w->m, value, text, sizeof(text));
+	if (!isnan(previous)) format_metric(w->m, previous, before, sizeof(before));
+
+	switch (output_format) {
+		case FORMAT_CSV:
+			fprintf(out, "%lld.%03ld,%s,%s,", (long long)now.tv_sec, now.tv_nsec / 1000000, w->m->name, event);
+			if (!isnan(value)) fprintf(out, "%.*f", w->m->precision, value);
+			fprintf(out, ",%s,", (w->m->type != METRIC_NUMBER) ? text : "");
+			if (!isnan(previous)) fprintf(out, "%.*f", w->m->precision, previous);
+			fprintf(out, ",");
+			if (!isnan(threshold)) fprintf(out, "%.*f", w->m->precision, threshold);
+			fprintf(out, ",%s\n", (w->m->unit != NULL) ? w->m->unit : "");
+			break;
+		case FORMAT_JSON:
+			// One object per line, as events are output when they happen
+			fprintf(out, "{\"name\": \"%s\", \"event\": \"%s\", ", w->m->name, event);
+			if (!isnan(value)) fprintf(out, "\"value\": %.*f, ", w->m->precision, value);
+			else fprintf(out, "\"value\": null, ");
+			if ((w->m->type != METRIC_NUMBER) && !isnan(value)) fprintf(out, "\"text\": \"%s\", ", text);
+			if (!isnan(previous)) fprintf(out, "\"previous\": %.*f, ", w->m->precision, previous);
+			if (!isnan(threshold)) fprintf(out, "\"threshold\": %.*f, ", w->m->precision, threshold);
+			if (w->m->unit != NULL) fprintf(out, "\"unit\": \"%s\", ", w->m->unit);
+			else fprintf(out, "\"unit\": null, ");
+			fprintf(out, "\"timestamp\": %lld.%03ld}\n", (long long)now.tv_sec, now.tv_nsec / 1000000);
+			break;
+		default: {
+			char date[32];
+			struct tm local;
+			localtime_r(&now.tv_sec, &local);
+			strftime(date, sizeof(date), "%Y-%m-%d %H:%M:%S", &local);
+
+			if (plain_output != 0) {
+				if (!isnan(value)) fprintf(out, "%s %s %s %s\n", date, w->m->name, event, text);
+				else fprintf(out, "%s %s %s\n", date, w->m->name, event);
+				break;
+			}
+
+			if (isnan(value)) {
+				fprintf(out, "%s %s: could not be read\n", date, w->m->label);
+				break;
+			}
+
+			if (w->m->unit != NULL) fprintf(out, "%s %s (%s): %s", date, w->m->label, w->m->unit, text);
+			else fprintf(out, "%s %s: %s", date, w->m->label, text);
+			if (!isnan(threshold)) fprintf(out, ", %s %.*f\n", event, w->m->precision, threshold);
+			else if (!isnan(previous)) fprintf(out, ", was %s\n", before);
+			else fprintf(out, "\n");
+			break;
+		}
+	}
+	fflush(out);
+
+	if (hook_command != NULL) run_hook(ctx, w, event, text, before, threshold);
+}
+
+// Reports the first value of every metric, then only its changes, crossings
+// of its thresholds and the first of consecutive failed reads
+// A value crosses a threshold upwards when it reaches it and downwards when it
+// falls below it by more than the hysteresis
+static void check(solar_ctx *ctx, watched_metric *w, double value) {
+	int i;
+	if (isnan(value)) {
+		if (w->failing == 0) emit(ctx, w, "error", NAN, w->last, NAN);
+		w->failing = 1;
+		return;
+	}
+	w->failing = 0;
+
+	if (isnan(w->last)) {
+		emit(ctx, w, "initial", value, NAN, NAN);
+		for (i = 0; i < w->thresholds_count; i++) {
+			w->above[i] = (value >= w->thresholds[i]);
+		}
+		w->reported = value;
+		w->last = value;
+		return;
+	}
+
+	for (i = 0; i < w->thresholds_count; i++) {
+		double t = w->thresholds[i];
+		if ((w->above[i] != 0) && (value < t - w->hysteresis)) {
+			emit(ctx, w, "below", value, w->last, t);
+			w->above[i] = 0;
+		}
+		else if ((w->above[i] == 0) && (value >= t)) {
+			emit(ctx, w, "above", value, w->last, t);
+			w->above[i] = 1;
+		}
+	}
+
+	if ((w->changes != 0) && changed(w, value)) {
+		emit(ctx, w, "change", value, w->reported, NAN);
+		w->reported = value;
+	}
+
+	w->last = value;
+}
+
+int pli_watch(solar_ctx *ctx) {
+	if (arguments_count == 0) return pli_get(ctx);
+
+	if (output_format == FORMAT_PROM) {
+		fprintf(stderr, "Output format 'prom' is not supported by 'watch' command.\n");
+		return 1;
+	}
+
+	watched_metric watched[arguments_count];
+	metric *metrics[arguments_count];
+	int i;
+	for (i = 0; i < arguments_count; i++) {
+		if (parse_watch(arguments[i], &watched[i]) == -1) {
+			fprintf(stderr, "Invalid watched metric '%s'.\n", arguments[i]);
+			return 1;
+		}
+		metrics[i] = watched[i].m;
+	}
+
+	// Hooks are not waited for
+	if (hook_command != NULL) signal(SIGCHLD, SIG_IGN);
+
+	if (output_format == FORMAT_CSV) fprintf(out, "timestamp,name,event,value,text,previous,threshold,unit\n");
+
+	while (1) {
+		long long start = monotonic_ms();
+
+		// Every read gets fresh values of just the watched registers
+		invalidate_cache(ctx);
+
+		double values[arguments_count];
+		read_metrics(ctx, metrics, arguments_count, values);
+
+		// Display is not kept awake between reads
+		pli_finish(ctx);
+
+		for (i = 0; i < arguments_count; i++) {
+			check(ctx, &watched[i], values[i]);
+		}
+
+		sleep_ms(start + interval * 1000LL - monotonic_ms());
+	}
+
+	return 0;
+}
@@ -0,0 +1,26 @@
+#ifndef WATCH_H_
+#define WATCH_H_
+
+#include "solar.h"
+#include "metric.h"
+
+#define WATCH_THRESHOLDS 4
+
+// A metric given to the watch command as
+// <metric>[:<deadband>][@<threshold>,...][~<hysteresis>]
+typedef struct {
+	metric *m;
+	double deadband; // Negative if changes are compared as output
+	int changes; // Whether changes are reported, not just threshold crossings
+	double thresholds[WATCH_THRESHOLDS];
+	int above[WATCH_THRESHOLDS]; // Whether the value last crossed the threshold upwards
+	int thresholds_count;
+	double hysteresis; // How far below a threshold the value has to fall to cross it downwards
+	double reported; // Value of the last reported change
+	double last; // Value of the last read, NAN before the first one
+	int failing; // Whether the last read failed
+} watched_metric;
+
+int pli_watch(solar_ctx *ctx);
+
+#endif /* WATCH_H_ */